@@ -0,0 +1,360 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FILE_NAME "/proc/mp2/status"
+#define MAX_TASKS 16 // MP2 batch registration limit
+#define CALIBRATION_NS 50000ULL // CPU time between clock reads while burning
+
+/**
+ * @brief one task of the task set, as read from the task set file
+ */
+struct bench_task {
+	unsigned computation;
+	unsigned period;
+	unsigned jobs;
+	pid_t pid;
+};
+
+/**
+ * @brief one job of one task, as stored in the binary log
+ */
+struct bench_record {
+	uint32_t task;
+	uint32_t pid;
+	uint32_t job;
+	uint32_t pad;
+	uint64_t release_ns;
+	uint64_t start_ns;
+	uint64_t finish_ns;
+};
+
+static struct bench_task tasks[MAX_TASKS];
+static unsigned ntasks;
+static unsigned long burn_chunk;
+
+/**
+ * @brief now_ns - reads a clock in nanoseconds
+ * @param clock - CLOCK_MONOTONIC or CLOCK_THREAD_CPUTIME_ID
+ * @return the time in nanoseconds
+ */
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief spin - the unit of work of a job
+ * @param n - number of iterations
+ */
+static void spin(unsigned long n)
+{
+	volatile unsigned long x;
+	for(x = 0; x < n; x++);
+}
+
+/**
+ * @brief calibrate - finds how many spin iterations take CALIBRATION_NS of CPU
+ * time, so burn only reads the clock every CALIBRATION_NS
+ */
+static void calibrate(void)
+{
+	uint64_t t0, elapsed;
+	unsigned long n = 1024;
+
+	do {
+		n *= 2;
+		t0 = now_ns(CLOCK_THREAD_CPUTIME_ID);
+		spin(n);
+		elapsed = now_ns(CLOCK_THREAD_CPUTIME_ID) - t0;
+	} while(elapsed < 10 * CALIBRATION_NS);
+
+	burn_chunk = n * CALIBRATION_NS / elapsed;
+	if(!burn_chunk) burn_chunk = 1;
+}
+
+/**
+ * @brief burn - consumes the given amount of CPU time of the calling thread.
+ * Time spent preempted does not count, unlike wall clock busy waits.
+ * @param ns - CPU time to consume
+ */
+static void burn(uint64_t ns)
+{
+	uint64_t start = now_ns(CLOCK_THREAD_CPUTIME_ID);
+	while(now_ns(CLOCK_THREAD_CPUTIME_ID) - start < ns)
+		spin(burn_chunk);
+}
+
+/**
+ * @brief mp2_command - writes one command to the MP2 procfs file
+ * @param fd - the open procfs file
+ * @param cmd - the command
+ * @return 0 on success, -1 if the module rejected it
+ */
+static int mp2_command(int fd, const char *cmd)
+{
+	return write(fd, cmd, strlen(cmd)) == (ssize_t)strlen(cmd) ? 0 : -1;
+}
+
+/**
+ * @brief worker - runs the jobs of one task and logs them. Waits on the start
+ * pipe until the parent registered the task set.
+ * @param idx - index of the task
+ * @param start_fd - read end of the start pipe
+ * @param log_fd - the binary log
+ * @return exit status of the worker
+ */
+static int worker(unsigned idx, int start_fd, int log_fd)
+{
+	struct bench_task *t = &tasks[idx];
+	struct bench_record rec;
+	char cmd[100];
+	char go;
+	uint64_t first_release;
+	unsigned job;
+	int fd;
+
+	pid_t pid = getpid();
+
+	if(read(start_fd, &go, 1) != 1 || go != 'G') return 1;
+
+	fd = open(FILE_NAME, O_RDWR);
+	if(fd < 0) return 1;
+
+	// The first release is one period after the first yield
+	sprintf(cmd, "Y, %u", pid);
+	first_release = now_ns(CLOCK_MONOTONIC) + (uint64_t)t->period * 1000000ULL;
+	mp2_command(fd, cmd);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.task = idx;
+	rec.pid = pid;
+	for(job = 0; job < t->jobs; job++){
+		rec.job = job;
+		rec.release_ns = first_release + (uint64_t)job * t->period * 1000000ULL;
+		rec.start_ns = now_ns(CLOCK_MONOTONIC);
+		burn((uint64_t)t->computation * 1000000ULL);
+		rec.finish_ns = now_ns(CLOCK_MONOTONIC);
+
+		if(write(log_fd, &rec, sizeof(rec)) != sizeof(rec)) perror("log write");
+		mp2_command(fd, cmd);
+	}
+
+	sprintf(cmd, "D, %u", pid);
+	mp2_command(fd, cmd);
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief read_taskset - parses a task set file. Each line holds
+ * "computation(ms) period(ms) jobs", lines starting with # are ignored.
+ * @param fname - the task set file
+ * @return 0 on success, -1 on error
+ */
+static int read_taskset(const char *fname)
+{
+	char line[256];
+	FILE *f = fopen(fname, "r");
+	if(!f){
+		perror(fname);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)){
+		struct bench_task t;
+		if(line[0] == '#') continue;
+		if(sscanf(line, "%u %u %u", &t.computation, &t.period, &t.jobs) != 3) continue;
+		if(ntasks == MAX_TASKS){
+			fprintf(stderr, "%s: more than %d tasks\n", fname, MAX_TASKS);
+			fclose(f);
+			return -1;
+		}
+		tasks[ntasks].computation = t.computation;
+		tasks[ntasks].period = t.period;
+		tasks[ntasks].jobs = t.jobs;
+		ntasks++;
+	}
+	fclose(f);
+	return ntasks ? 0 : -1;
+}
+
+/**
+ * @brief register_taskset - registers all workers with one batch command so
+ * the task set is admitted or rejected as a whole
+ * @return 0 if admitted, -1 otherwise
+ */
+static int register_taskset(void)
+{
+	char cmd[100 * MAX_TASKS];
+	char verdict[2048];
+	unsigned i;
+	int offset, fd, ret;
+	ssize_t len;
+
+	offset = sprintf(cmd, "B");
+	for(i = 0; i < ntasks; i++)
+		offset += sprintf(cmd + offset, "%s %u, %u, %u", i ? ";" : ",", tasks[i].pid, tasks[i].period, tasks[i].computation);
+
+	fd = open(FILE_NAME, O_RDWR);
+	if(fd < 0){
+		printf("Cannot find proc entry, is the kernel module running?\n");
+		return -1;
+	}
+	ret = mp2_command(fd, cmd);
+	len = read(fd, verdict, sizeof(verdict) - 1);
+	if(len > 0){
+		verdict[len] = '\0';
+		printf("%s", verdict);
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * @brief cmp_u64 - qsort comparator for uint64_t
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief percentile - nearest rank percentile of a sorted array
+ */
+static double percentile(const uint64_t *v, size_t n, double p)
+{
+	size_t rank = (size_t)(p / 100.0 * n + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > n) rank = n;
+	return v[rank - 1] / 1e6;
+}
+
+/**
+ * @brief report - prints response time percentiles and deadline misses per
+ * task from the binary log
+ * @param log_name - the binary log
+ */
+static void report(const char *log_name)
+{
+	struct bench_record rec;
+	uint64_t *resp[MAX_TASKS];
+	size_t n[MAX_TASKS];
+	unsigned misses[MAX_TASKS];
+	double jitter_max[MAX_TASKS];
+	unsigned i;
+	FILE *f = fopen(log_name, "rb");
+
+	if(!f){
+		perror(log_name);
+		return;
+	}
+	for(i = 0; i < ntasks; i++){
+		resp[i] = calloc(tasks[i].jobs ? tasks[i].jobs : 1, sizeof(uint64_t));
+		n[i] = 0;
+		misses[i] = 0;
+		jitter_max[i] = 0;
+	}
+	while(fread(&rec, sizeof(rec), 1, f) == 1){
+		double jitter;
+		if(rec.task >= ntasks || n[rec.task] >= tasks[rec.task].jobs) continue;
+		resp[rec.task][n[rec.task]++] = rec.finish_ns - rec.release_ns;
+		if(rec.finish_ns > rec.release_ns + (uint64_t)tasks[rec.task].period * 1000000ULL)
+			misses[rec.task]++;
+		jitter = ((double)rec.start_ns - (double)rec.release_ns) / 1e6;
+		if(jitter > jitter_max[rec.task]) jitter_max[rec.task] = jitter;
+	}
+	fclose(f);
+
+	printf("%-6s %-8s %-8s %-6s %-9s %-9s %-9s %-9s %-11s %s\n", "task", "C(ms)", "P(ms)", "jobs",
+		"p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "jitter(ms)", "misses");
+	for(i = 0; i < ntasks; i++){
+		if(!n[i]){
+			printf("%-6u %-8u %-8u %-6u no jobs logged\n", i, tasks[i].computation, tasks[i].period, 0);
+		} else {
+			qsort(resp[i], n[i], sizeof(uint64_t), cmp_u64);
+			printf("%-6u %-8u %-8u %-6zu %-9.3f %-9.3f %-9.3f %-9.3f %-11.3f %u\n", i,
+				tasks[i].computation, tasks[i].period, n[i],
+				percentile(resp[i], n[i], 50), percentile(resp[i], n[i], 90),
+				percentile(resp[i], n[i], 99), resp[i][n[i] - 1] / 1e6, jitter_max[i], misses[i]);
+		}
+		free(resp[i]);
+	}
+}
+
+/**
+ * @brief main -- Runs a task set under MP2 and reports response times. Every
+ * task is a forked worker that burns its computation time in CPU time, logs
+ * the release, start and finish of every job to a binary log and yields.
+ * @param argc - number of arguments
+ * @param argv - task set file and optional log file
+ * @return 2 if invalid syntax, 1 if the task set was rejected, 0 if successful
+ */
+int main(int argc, char* argv[])
+{
+	const char *log_name = "bench.log";
+	int start_pipe[2];
+	int log_fd, status;
+	unsigned i;
+
+	if(argc < 2){
+		printf("Usage: ./bench [task set file] [log file]\n");
+		printf("Each line of the task set file is: computation(ms) period(ms) jobs\n");
+		return 2;
+	}
+	if(argc > 2) log_name = argv[2];
+	if(read_taskset(argv[1])) return 2;
+
+	calibrate();
+
+	log_fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(log_fd < 0 || pipe(start_pipe)){
+		perror(log_name);
+		return 2;
+	}
+
+	for(i = 0; i < ntasks; i++){
+		tasks[i].pid = fork();
+		if(tasks[i].pid < 0){
+			//kill(-1) would signal every process, so only kill the forked workers
+			perror("fork");
+			while(i--) kill(tasks[i].pid, SIGKILL);
+			close(start_pipe[1]);
+			while(wait(&status) > 0);
+			return 2;
+		}
+		if(tasks[i].pid == 0){
+			close(start_pipe[1]);
+			exit(worker(i, start_pipe[0], log_fd));
+		}
+	}
+	close(start_pipe[0]);
+
+	if(register_taskset()){
+		printf("Task set is not admissible\n");
+		for(i = 0; i < ntasks; i++) kill(tasks[i].pid, SIGKILL);
+		close(start_pipe[1]);
+		while(wait(&status) > 0);
+		return 1;
+	}
+
+	for(i = 0; i < ntasks; i++){
+		if(write(start_pipe[1], "G", 1) != 1) perror("start");
+	}
+	close(start_pipe[1]);
+	while(wait(&status) > 0);
+	close(log_fd);
+
+	report(log_name);
+	return 0;
+}
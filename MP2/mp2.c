@@ -8,12 +8,23 @@
 #include <linux/uaccess.h>	/* for copy_*_user */
 #include <linux/slab.h>
 #include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Group_ID");
 MODULE_DESCRIPTION("CS-423 MP2");
 
+//scheduling backend: "kthread" dispatcher or the kernel's "deadline" class
+static char *backend = "kthread";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Scheduling backend: kthread (default) or deadline");
+
 #define PROCFS_MAX_SIZE 2048
+#define MP2_MAX_BATCH 16
+#define MP2_VERDICT_LINE 64
+#define MP2_MAX_LOCK_USERS 16
+#define MP2_MAX_DEMOTE 8
 #define DEBUG 1
 
 /**
@@ -37,11 +48,47 @@ typedef struct mp2_task_struct_t {
 		pid_t pid;
 
 		mp2_task_state task_state;
+		bool needs_wakeup; //chosen to run but not woken yet
+		bool fifo; //currently running under SCHED_FIFO
 		unsigned long deadline_jiffies;
 		unsigned int period_ms;
 		unsigned int computation_ms;
+
+		//task was moved to SCHED_DEADLINE by the deadline backend
+		bool dl_attached;
+
+		//period used for dispatching, raised to the ceiling of held locks
+		unsigned int priority_period_ms;
+		//number of locks held, written under task_struct_mutex and sched_lock
+		unsigned int held_locks;
+
+		//mode change applied at the next release
+		bool mode_change_pending;
+		unsigned int pending_period_ms;
+		unsigned int pending_computation_ms;
 } mp2_task_struct;
 
+/**
+ * @brief the mp2_lock contains a lock shared by mp2 tasks along with the tasks
+ * that declared they use it and their longest critical section
+ */
+typedef struct mp2_lock_t {
+		struct list_head lock_node;
+		unsigned int id;
+
+		mp2_task_struct *holder;
+		wait_queue_head_t waiters;
+
+		unsigned int num_users;
+		mp2_task_struct *users[MP2_MAX_LOCK_USERS];
+		unsigned int cs_ms[MP2_MAX_LOCK_USERS];
+
+		//tasks sleeping in mp2_acquire_lock, which keep the lock allocated
+		unsigned int sleepers;
+		//the last user is gone, the last sleeper frees the lock
+		bool dead;
+} mp2_lock;
+
 
 //procfs variables
 static unsigned long procfs_buffer_size = 0;
@@ -56,68 +103,194 @@ struct kmem_cache * mp2_cache;
 //dispatch task task_struct
 struct task_struct * mp2_dispatch_task;
 
+//true if admitted tasks are run by SCHED_DEADLINE instead of the dispatcher
+bool use_deadline_backend;
+
 //linked list variables
 unsigned num_entries;
 
 mp2_task_struct head;
 mp2_task_struct * currently_running_task;
 
+//shared locks, protected by task_struct_mutex
+LIST_HEAD(lock_list);
+
 //parameter for scheduling
 struct sched_param sparam_fifo;
 struct sched_param sparam_normal;
+struct sched_param sparam_dispatch;
 
 //mutexes
 struct mutex task_struct_mutex;
-struct mutex currently_running_task_mutex;
+struct mutex dispatch_mutex;
+
+//protects the task list, task states and currently_running_task. Taken by the
+//release timers, so process context uses the _bh variants. Nests inside
+//task_struct_mutex and dispatch_mutex.
+DEFINE_SPINLOCK(sched_lock);
 
 /**
- * @brief find_mp2_task_struct_by_pid Finds the mp2_task_struct in the linked list
- * based on the provided pid.
+ * @brief find_mp2_task_struct_by_pid_locked Finds the mp2_task_struct in the
+ * linked list based on the provided pid. The caller must hold task_struct_mutex
+ * or sched_lock.
  * @param pid - the pid of the mp2_task_struct to find
  * @return pointer to the mp2_task_struct
  */
-mp2_task_struct * find_mp2_task_struct_by_pid(pid_t pid){
+mp2_task_struct * find_mp2_task_struct_by_pid_locked(pid_t pid){
 	struct list_head * pos;
-	mutex_lock(&task_struct_mutex);
 	list_for_each(pos, &head.task_node){
 		mp2_task_struct * tmp = list_entry(pos, mp2_task_struct, task_node);
 		if(tmp->pid == pid){
-			mutex_unlock(&task_struct_mutex);
 			return tmp;
 		}
 	}
-	mutex_unlock(&task_struct_mutex);
 	return NULL;
 }
 
 /**
- * @brief timer_callback - handler function whenever a task's release timer
- * expires. This function sets the task's run state to READY.
- * @param data - contains the pid of the caller
+ * @brief find_mp2_task_struct_by_pid Finds the mp2_task_struct in the linked list
+ * based on the provided pid.
+ * @param pid - the pid of the mp2_task_struct to find
+ * @return pointer to the mp2_task_struct
  */
-void timer_callback(unsigned long data){
-	pid_t pid = (pid_t) data;
-	mp2_task_struct * task_struct = find_mp2_task_struct_by_pid(pid);
+mp2_task_struct * find_mp2_task_struct_by_pid(pid_t pid){
+	mp2_task_struct * tmp;
+	mutex_lock(&task_struct_mutex);
+	tmp = find_mp2_task_struct_by_pid_locked(pid);
+	mutex_unlock(&task_struct_mutex);
+	return tmp;
+}
 
-	int result = 0;
+/**
+ * @brief pick_next_locked - Decides which task runs next. The ready task with
+ * the shortest (ceiling) period replaces the running task if there is none or
+ * if it has a shorter period. The decision is committed to the task states right
+ * away, only the scheduling policy changes are left to mp2_apply. The caller
+ * must hold sched_lock.
+ * @return true if the running task changed
+ */
+bool pick_next_locked(void){
+	struct list_head *pos;
+	mp2_task_struct *tmp, *next = NULL;
 
-	if(task_struct){
-		task_struct->task_state = READY;
-		task_struct->deadline_jiffies += msecs_to_jiffies(task_struct->period_ms);
-		mod_timer(&task_struct->wakeup_timer, task_struct->deadline_jiffies);
+	list_for_each(pos, &head.task_node){
+		tmp = list_entry(pos, mp2_task_struct, task_node);
+		if((tmp->task_state == READY) && (!next || tmp->priority_period_ms < next->priority_period_ms)){
+			next = tmp;
+		}
+	}
 
-		result = wake_up_process(mp2_dispatch_task);
-//		printk(KERN_ALERT "Set ready process with pid %u and set it's next deadline to %lu. Wakeup result: %d\n", pid, task_struct->deadline_jiffies, result);
+	if(!next) return false;
+	if(currently_running_task){
+		if(next->priority_period_ms >= currently_running_task->priority_period_ms) return false;
+		//preemption
+		currently_running_task->task_state = READY;
+	}
+	next->task_state = RUNNING;
+	next->needs_wakeup = true;
+	currently_running_task = next;
+	return true;
+}
 
-	} else {
-		printk(KERN_ALERT "Timer interrupt for unknown PID: %u\n", pid);
+/**
+ * @brief mp2_apply - Brings the scheduling policies in line with the task
+ * states: the running task is moved to SCHED_FIFO and woken, preempted tasks
+ * are moved back to SCHED_NORMAL. This is the part of a dispatch that may
+ * sleep, so it only runs in process context.
+ */
+void mp2_apply(void){
+	struct list_head *pos;
+	mp2_task_struct *tmp, *promote = NULL;
+	mp2_task_struct *demote[MP2_MAX_DEMOTE];
+	unsigned int i, num_demote;
+	bool more;
+
+	mutex_lock(&dispatch_mutex);
+	//demote in batches of MP2_MAX_DEMOTE until no READY task is left in SCHED_FIFO
+	do {
+		more = false;
+		num_demote = 0;
+		spin_lock_bh(&sched_lock);
+		list_for_each(pos, &head.task_node){
+			tmp = list_entry(pos, mp2_task_struct, task_node);
+			if(tmp == currently_running_task){
+				if(tmp->needs_wakeup) promote = tmp;
+				tmp->needs_wakeup = false;
+			} else if(tmp->task_state == READY && tmp->fifo){
+				if(num_demote < MP2_MAX_DEMOTE) demote[num_demote++] = tmp;
+				else more = true;
+			}
+		}
+		spin_unlock_bh(&sched_lock);
+
+		//fifo is only touched here, under dispatch_mutex
+		for(i = 0; i < num_demote; i++){
+			sched_setscheduler(demote[i]->linux_task, SCHED_NORMAL, &sparam_normal);
+			demote[i]->fifo = false;
+		}
+	} while(more);
+	if(promote){
+		if(!promote->fifo){
+			sched_setscheduler(promote->linux_task, SCHED_FIFO, &sparam_fifo);
+			promote->fifo = true;
+		}
+		wake_up_process(promote->linux_task);
+	}
+	mutex_unlock(&dispatch_mutex);
+}
+
+/**
+ * @brief mp2_dispatch - Makes a scheduling decision and applies it directly
+ * from process context, without going through the dispatcher thread.
+ */
+void mp2_dispatch(void){
+	spin_lock_bh(&sched_lock);
+	pick_next_locked();
+	spin_unlock_bh(&sched_lock);
+	mp2_apply();
+}
+
+/**
+ * @brief timer_callback - handler function whenever a task's release timer
+ * expires. This function sets the task's run state to READY and decides right
+ * away whether it preempts the running task. Only if the running task changes
+ * is the dispatcher thread woken, since sched_setscheduler can not be called
+ * from the timer.
+ * @param data - the mp2_task_struct of the released task
+ */
+void timer_callback(unsigned long data){
+	mp2_task_struct * task_struct = (mp2_task_struct *) data;
+	bool changed;
+
+	spin_lock(&sched_lock);
+	//a task that overran its period keeps running
+	if(task_struct->task_state == SLEEPING)
+		task_struct->task_state = READY;
+	//apply a pending mode change at the release boundary
+	if(task_struct->mode_change_pending){
+		task_struct->period_ms = task_struct->pending_period_ms;
+		task_struct->computation_ms = task_struct->pending_computation_ms;
+		task_struct->mode_change_pending = false;
 	}
+	//a task that overran its period may still hold a lock and keeps its
+	//ceiling, which update_priority_locked computed with any pending change
+	if(!task_struct->held_locks)
+		task_struct->priority_period_ms = task_struct->period_ms;
+	task_struct->deadline_jiffies += msecs_to_jiffies(task_struct->period_ms);
+	mod_timer(&task_struct->wakeup_timer, task_struct->deadline_jiffies);
+
+	changed = pick_next_locked();
+	spin_unlock(&sched_lock);
+
+	if(changed)
+		wake_up_process(mp2_dispatch_task);
 }
 
 /**
  * @brief mp2_read - handler function for read. Called whenever a read is made
- * to the procfs file.
- * @param file - unused
+ * to the procfs file. If a batch registration was written to this file, its
+ * verdict is returned instead of the task list.
+ * @param file - holds the verdict of the last batch registration on this file
  * @param buffer - userspace buffer to copy written data to
  * @param count - size of buffer
  * @param data - used to delineate if it was the first time this function was called
@@ -129,6 +302,17 @@ static ssize_t mp2_read(struct file *file, char __user *buffer, size_t count, lo
 	struct list_head *pos;
 	unsigned offset = 0;
 
+	//Return the batch verdict once
+	if(file->private_data){
+		len = simple_read_from_buffer(buffer, count, data, file->private_data, strlen(file->private_data));
+		if(len <= 0){
+			kfree(file->private_data);
+			file->private_data = NULL;
+			*data = 0;
+		}
+		return len;
+	}
+
 	//Copy to buffer if no previous data
 	if(!(num_entries && *data)){
 		kernelbuffer = (char*) kcalloc(100, sizeof(char), GFP_ATOMIC);
@@ -158,6 +342,136 @@ static ssize_t mp2_read(struct file *file, char __user *buffer, size_t count, lo
 	return 0;
 }
 
+/**
+ * @brief task_utilization - Utilization of a registered task in units of 1/10000.
+ * While a mode change is pending the larger of the old and new utilization is
+ * used, since the old parameters stay in effect until the next release.
+ * @param tmp - the task
+ * @return utilization of the task
+ */
+unsigned int task_utilization(mp2_task_struct *tmp){
+	unsigned int u = tmp->computation_ms * 10000 / tmp->period_ms;
+	unsigned int pending_u;
+	if(tmp->mode_change_pending){
+		pending_u = tmp->pending_computation_ms * 10000 / tmp->pending_period_ms;
+		if(pending_u > u) u = pending_u;
+	}
+	return u;
+}
+
+/**
+ * @brief admission_period - Period of a task as seen by admission control. The
+ * excluded task is the one being re-admitted with a new period.
+ * @param tmp - the task
+ * @param exclude - task being re-admitted, or NULL
+ * @param p - new period of the excluded task
+ * @return the period
+ */
+unsigned int admission_period(mp2_task_struct *tmp, mp2_task_struct *exclude, unsigned p){
+	return tmp == exclude ? p : tmp->period_ms;
+}
+
+/**
+ * @brief lock_ceiling_locked - The priority ceiling of a lock, i.e. the shortest
+ * period of the tasks that use it. A pending mode change counts from the moment
+ * it is admitted, so the holder is raised before the new period takes effect.
+ * The caller must hold task_struct_mutex.
+ * @param lock - the lock
+ * @param exclude - task being re-admitted, or NULL
+ * @param p - new period of the excluded task
+ * @return the ceiling as a period, UINT_MAX if the lock has no users
+ */
+unsigned int lock_ceiling_locked(mp2_lock *lock, mp2_task_struct *exclude, unsigned p){
+	unsigned int i, ceiling = UINT_MAX;
+	for(i = 0; i < lock->num_users; i++){
+		ceiling = min(ceiling, admission_period(lock->users[i], exclude, p));
+		if(lock->users[i] != exclude && lock->users[i]->mode_change_pending)
+			ceiling = min(ceiling, lock->users[i]->pending_period_ms);
+	}
+	return ceiling;
+}
+
+/**
+ * @brief blocking_time_locked - Worst-case time a task with the given period can
+ * be blocked under the priority ceiling protocol: the longest critical section
+ * of a lower priority task on a lock whose ceiling is at least the task's
+ * priority. The caller must hold task_struct_mutex.
+ * @param period - period of the blocked task
+ * @param self - the blocked task, whose own critical sections do not count
+ * @param exclude - task being re-admitted, or NULL
+ * @param p - new period of the excluded task
+ * @return the blocking time in ms
+ */
+unsigned int blocking_time_locked(unsigned int period, mp2_task_struct *self, mp2_task_struct *exclude, unsigned p){
+	struct list_head *pos;
+	unsigned int i, blocking = 0;
+	list_for_each(pos, &lock_list){
+		mp2_lock * lock = list_entry(pos, mp2_lock, lock_node);
+		if(lock_ceiling_locked(lock, exclude, p) > period) continue;
+		for(i = 0; i < lock->num_users; i++){
+			if(lock->users[i] != self && admission_period(lock->users[i], exclude, p) > period)
+				blocking = max(blocking, lock->cs_ms[i]);
+		}
+	}
+	return blocking;
+}
+
+/**
+ * @brief isSchedulable_locked - Rate monotonic test with blocking. For every
+ * task i, the utilization of all tasks with a period no longer than i's plus
+ * i's blocking time over its period must stay within the utilization bound.
+ * Without locks this reduces to the total utilization test. The caller must
+ * hold task_struct_mutex.
+ * @param c - computation time of the candidate task
+ * @param p - period of the candidate task, 0 if there is no candidate
+ * @param exclude - registered task the candidate replaces, or NULL
+ * @return 1 if schedulable, 0 if not
+ */
+bool isSchedulable_locked(unsigned c, unsigned p, mp2_task_struct *exclude){
+	struct list_head *pos, *pos2;
+	unsigned int sum, period;
+	mp2_task_struct *self;
+	bool candidate = p != 0;
+
+	//the candidate is checked first, then every registered task
+	pos = candidate ? NULL : head.task_node.next;
+	while(pos != &head.task_node){
+		if(pos){
+			self = list_entry(pos, mp2_task_struct, task_node);
+			pos = pos->next;
+			if(self == exclude) continue;
+			period = self->period_ms;
+		} else {
+			self = exclude;
+			pos = head.task_node.next;
+			period = p;
+		}
+
+		sum = (candidate && p <= period) ? c * 10000 / p : 0;
+		list_for_each(pos2, &head.task_node){
+			mp2_task_struct * tmp = list_entry(pos2, mp2_task_struct, task_node);
+			if(tmp != exclude && tmp->period_ms <= period)
+				sum += task_utilization(tmp);
+		}
+		sum += blocking_time_locked(period, self, exclude, p) * 10000 / period;
+		if(sum > 6930) return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief isAdmissible_locked - Checks to see if the function is admissible and
+ * passes utilization criteria. The caller must hold task_struct_mutex.
+ * @param c - computation time of new task
+ * @param p - period of new task
+ * @param exclude - registered task to leave out of the sum, or NULL
+ * @return 1 if schedulable, 0 if not
+ */
+bool isAdmissible_locked(unsigned c, unsigned p, mp2_task_struct *exclude){
+	if(!p || c > p) return 0;
+	return isSchedulable_locked(c, p, exclude);
+}
+
 /**
  * @brief isAdmissible - Checks to see if the function is admissible and passes
  * utilization criteria
@@ -166,34 +480,442 @@ static ssize_t mp2_read(struct file *file, char __user *buffer, size_t count, lo
  * @return 1 if schedulable, 0 if not
  */
 bool isAdmissible(unsigned c, unsigned p){
+	bool result;
+	mutex_lock(&task_struct_mutex);
+	result = isAdmissible_locked(c, p, NULL);
+	mutex_unlock(&task_struct_mutex);
+	return result;
+}
+
+/**
+ * @brief find_mp2_lock_by_id_locked - Finds a lock by its id. The caller must
+ * hold task_struct_mutex.
+ * @param id - the id of the lock
+ * @return pointer to the mp2_lock, NULL if there is none
+ */
+mp2_lock * find_mp2_lock_by_id_locked(unsigned int id){
+	struct list_head *pos;
+	list_for_each(pos, &lock_list){
+		mp2_lock * lock = list_entry(pos, mp2_lock, lock_node);
+		if(lock->id == id) return lock;
+	}
+	return NULL;
+}
+
+/**
+ * @brief update_priority_locked - Recomputes the dispatching priority of a task
+ * from its period and the ceilings of the locks it holds. The caller must hold
+ * task_struct_mutex.
+ * @param tmp - the task
+ */
+void update_priority_locked(mp2_task_struct *tmp){
 	struct list_head *pos;
+	unsigned int priority = tmp->period_ms;
+	list_for_each(pos, &lock_list){
+		mp2_lock * lock = list_entry(pos, mp2_lock, lock_node);
+		if(lock->holder == tmp)
+			priority = min(priority, lock_ceiling_locked(lock, NULL, 0));
+	}
+	spin_lock_bh(&sched_lock);
+	tmp->priority_period_ms = priority;
+	spin_unlock_bh(&sched_lock);
+}
+
+/**
+ * @brief update_lock_holders_locked - Recomputes the priority of the holders of
+ * every lock a task uses, after the ceilings of those locks changed with the
+ * task's period or its declarations. The caller must hold task_struct_mutex.
+ * @param tmp - the task
+ */
+void update_lock_holders_locked(mp2_task_struct *tmp){
+	struct list_head *pos;
+	unsigned int i;
+	list_for_each(pos, &lock_list){
+		mp2_lock * lock = list_entry(pos, mp2_lock, lock_node);
+		if(!lock->holder) continue;
+		for(i = 0; i < lock->num_users && lock->users[i] != tmp; i++);
+		if(i < lock->num_users)
+			update_priority_locked(lock->holder);
+	}
+}
+
+/**
+ * @brief mp2_declare_lock - Declares that a task uses a lock with the given
+ * worst-case critical section, creating the lock if needed. The declaration is
+ * only kept if the task set stays schedulable with the new blocking times.
+ * @param pid - the task
+ * @param id - the lock
+ * @param cs_ms - longest critical section of the task on the lock
+ * @return 0 on success, -EBUSY if not admissible, -EINVAL, -ENOMEM
+ */
+int mp2_declare_lock(pid_t pid, unsigned int id, unsigned int cs_ms){
+	mp2_task_struct *tmp;
+	mp2_lock *lock, *new_lock;
+	unsigned int i, old_cs = 0;
+	bool created = false, existing = false, raised = false;
+	int ret = 0;
+
+	new_lock = kzalloc(sizeof(mp2_lock), GFP_KERNEL);
+	if(!new_lock) return -ENOMEM;
+
+	mutex_lock(&task_struct_mutex);
+	tmp = find_mp2_task_struct_by_pid_locked(pid);
+	if(!tmp || cs_ms > tmp->computation_ms){
+		ret = -EINVAL;
+		goto OUT;
+	}
+
+	lock = find_mp2_lock_by_id_locked(id);
+	if(!lock){
+		lock = new_lock;
+		new_lock = NULL;
+		lock->id = id;
+		init_waitqueue_head(&lock->waiters);
+		list_add(&lock->lock_node, &lock_list);
+		created = true;
+	}
+
+	for(i = 0; i < lock->num_users && lock->users[i] != tmp; i++);
+	if(i == MP2_MAX_LOCK_USERS){
+		ret = -EINVAL;
+		goto OUT;
+	}
+	if(i == lock->num_users){
+		lock->users[i] = tmp;
+		lock->num_users++;
+	} else {
+		old_cs = lock->cs_ms[i];
+		existing = true;
+	}
+	lock->cs_ms[i] = cs_ms;
+
+	if(!isSchedulable_locked(0, 0, NULL)){
+		printk(KERN_ALERT "Lock %u with critical section %u for PID: %u is not admissible.\n", id, cs_ms, pid);
+		ret = -EBUSY;
+		if(existing){
+			lock->cs_ms[i] = old_cs;
+		} else {
+			lock->num_users--;
+		}
+		if(created){
+			list_del(&lock->lock_node);
+			new_lock = lock;
+		}
+	} else if(lock->holder){
+		//a shorter period user raises the ceiling of a lock that is already held
+		update_priority_locked(lock->holder);
+		raised = true;
+	}
+OUT:
+	mutex_unlock(&task_struct_mutex);
+	kfree(new_lock);
+	//the raised holder may have to preempt the running task
+	if(raised && !use_deadline_backend)
+		mp2_dispatch();
+	return ret;
+}
+
+/**
+ * @brief mp2_acquire_lock - Acquires a lock for a task (immediate priority
+ * ceiling protocol). The task runs at the lock's ceiling until it releases it.
+ * If another task holds the lock, the caller sleeps until it is released.
+ * @param pid - the task
+ * @param id - the lock
+ * @return 0 on success, -EINVAL if the task did not declare the lock
+ */
+int mp2_acquire_lock(pid_t pid, unsigned int id){
+	mp2_task_struct *tmp;
+	mp2_lock *lock;
+	unsigned int i;
+	int ret;
+
+	mutex_lock(&task_struct_mutex);
+	while(1){
+		tmp = find_mp2_task_struct_by_pid_locked(pid);
+		lock = find_mp2_lock_by_id_locked(id);
+		if(!tmp || !lock) break;
+		for(i = 0; i < lock->num_users && lock->users[i] != tmp; i++);
+		if(i == lock->num_users) break;
+
+		if(!lock->holder){
+			lock->holder = tmp;
+			spin_lock_bh(&sched_lock);
+			tmp->held_locks++;
+			spin_unlock_bh(&sched_lock);
+			update_priority_locked(tmp);
+			mutex_unlock(&task_struct_mutex);
+			return 0;
+		}
+
+		lock->sleepers++;
+		mutex_unlock(&task_struct_mutex);
+		ret = wait_event_interruptible(lock->waiters, !lock->holder || lock->dead);
+		mutex_lock(&task_struct_mutex);
+		lock->sleepers--;
+		if(lock->dead){
+			if(!lock->sleepers) kfree(lock);
+			break;
+		}
+		if(ret){
+			mutex_unlock(&task_struct_mutex);
+			return ret;
+		}
+	}
+	mutex_unlock(&task_struct_mutex);
+	printk(KERN_ALERT "PID: %u acquiring undeclared lock %u\n", pid, id);
+	return -EINVAL;
+}
+
+/**
+ * @brief release_lock_locked - Releases a held lock, restores the holder's
+ * priority and wakes tasks waiting for the lock. The caller must hold
+ * task_struct_mutex.
+ * @param lock - the lock
+ */
+void release_lock_locked(mp2_lock *lock){
+	mp2_task_struct *holder = lock->holder;
+	lock->holder = NULL;
+	spin_lock_bh(&sched_lock);
+	holder->held_locks--;
+	spin_unlock_bh(&sched_lock);
+	update_priority_locked(holder);
+	wake_up_interruptible(&lock->waiters);
+}
+
+/**
+ * @brief mp2_release_lock - Releases a lock held by a task. A dispatch is made
+ * since a higher priority task may have been held off by the ceiling.
+ * @param pid - the task
+ * @param id - the lock
+ * @return 0 on success, -EINVAL if the task does not hold the lock
+ */
+int mp2_release_lock(pid_t pid, unsigned int id){
+	mp2_lock *lock;
+	int ret = -EINVAL;
+
+	mutex_lock(&task_struct_mutex);
+	lock = find_mp2_lock_by_id_locked(id);
+	if(lock && lock->holder && lock->holder->pid == pid){
+		release_lock_locked(lock);
+		ret = 0;
+	}
+	mutex_unlock(&task_struct_mutex);
+
+	if(ret)
+		printk(KERN_ALERT "PID: %u releasing lock %u it does not hold\n", pid, id);
+	else if(!use_deadline_backend)
+		mp2_dispatch();
+	return ret;
+}
+
+/**
+ * @brief remove_task_locks_locked - Releases the locks held by a task that is
+ * being removed, drops it from the users of every lock and frees locks that
+ * have no users left. The caller must hold task_struct_mutex.
+ * @param tmp - the task
+ */
+void remove_task_locks_locked(mp2_task_struct *tmp){
+	struct list_head *pos, *q;
+	unsigned int i;
+	list_for_each_safe(pos, q, &lock_list){
+		mp2_lock * lock = list_entry(pos, mp2_lock, lock_node);
+		if(lock->holder == tmp) release_lock_locked(lock);
+		for(i = 0; i < lock->num_users; i++){
+			if(lock->users[i] == tmp){
+				lock->num_users--;
+				lock->users[i] = lock->users[lock->num_users];
+				lock->cs_ms[i] = lock->cs_ms[lock->num_users];
+				break;
+			}
+		}
+		if(!lock->num_users){
+			list_del(pos);
+			//tasks still sleeping on the lock fail, and the last one frees it
+			if(lock->sleepers){
+				lock->dead = true;
+				wake_up_interruptible(&lock->waiters);
+			} else {
+				kfree(lock);
+			}
+		}
+	}
+}
+
+/**
+ * @brief mp2_deadline_attach - Runs a task under SCHED_DEADLINE with its
+ * computation time as runtime and its period as deadline and period. Used by
+ * the deadline backend instead of the dispatcher.
+ * @param tmp - the task
+ * @return 0 on success, the error of sched_setattr otherwise
+ */
+int mp2_deadline_attach(mp2_task_struct *tmp){
+	struct sched_attr attr = {
+		.size = sizeof(struct sched_attr),
+		.sched_policy = SCHED_DEADLINE,
+		.sched_flags = 0,
+		.sched_runtime = (u64)tmp->computation_ms * NSEC_PER_MSEC,
+		.sched_deadline = (u64)tmp->period_ms * NSEC_PER_MSEC,
+		.sched_period = (u64)tmp->period_ms * NSEC_PER_MSEC,
+	};
+	return sched_setattr(tmp->linux_task, &attr);
+}
+
+/**
+ * @brief mp2_deadline_detach - Returns a task run by the deadline backend to
+ * SCHED_NORMAL.
+ * @param tmp - the task
+ */
+void mp2_deadline_detach(mp2_task_struct *tmp){
+	if(tmp->dl_attached && tmp->linux_task)
+		sched_setscheduler(tmp->linux_task, SCHED_NORMAL, &sparam_normal);
+	tmp->dl_attached = false;
+}
+
+/**
+ * @brief mp2_alloc_task - Allocates and initializes a mp2_task_struct for a
+ * newly registered task. The task is not added to the list.
+ * @param pid - pid of the task
+ * @param period - period of the task
+ * @param computation - computation time of the task
+ * @return the new mp2_task_struct, NULL if out of memory
+ */
+mp2_task_struct * mp2_alloc_task(pid_t pid, unsigned int period, unsigned int computation){
+	mp2_task_struct * tmp = (mp2_task_struct*)kmem_cache_alloc(mp2_cache, GFP_KERNEL);
+	if(!tmp) return NULL;
+	tmp->pid = pid;
+	tmp->linux_task = find_task_by_pid(pid);
+	tmp->period_ms = period;
+	tmp->computation_ms = computation;
+	tmp->priority_period_ms = period;
+	tmp->held_locks = 0;
+	tmp->task_state = SLEEPING;
+	tmp->needs_wakeup = false;
+	tmp->fifo = false;
+	tmp->deadline_jiffies = 0;
+	tmp->mode_change_pending = false;
+	tmp->dl_attached = false;
+	setup_timer(&tmp->wakeup_timer, timer_callback, (unsigned long) tmp);
+	INIT_LIST_HEAD(&tmp->task_node);
+	return tmp;
+}
+
+/**
+ * @brief mp2_register_batch - Admits or rejects a whole task set at once. The
+ * set is written as "B, PID, PERIOD, COMPUTATION; PID, PERIOD, COMPUTATION; ...".
+ * Tasks are checked in order against the registered set plus the earlier tasks
+ * of the batch, and the batch is only registered if every task passes.
+ * @param spec - the batch, after the "B," prefix
+ * @param verdict - buffer for the per-task verdicts and resulting utilization
+ * @param verdict_len - size of verdict
+ * @return 0 if admitted, -EBUSY if rejected, -EINVAL if malformed, -ENOMEM
+ */
+int mp2_register_batch(char *spec, char *verdict, size_t verdict_len){
+	mp2_task_struct *batch[MP2_MAX_BATCH];
+	bool admitted[MP2_MAX_BATCH];
+	char *entry;
+	struct list_head *pos;
+	unsigned int i, j, n = 0;
 	unsigned int sum = 0;
-	sum += c * 10000 / p;
+	unsigned int period, computation;
+	pid_t pid;
+	bool all_admitted = true;
+	size_t offset = 0;
+
+	//parse and allocate before taking the lock
+	while((entry = strsep(&spec, ";")) != NULL){
+		//an empty entry, e.g. after a trailing ';', is not a task
+		if(!*skip_spaces(entry)) continue;
+		//a malformed entry rejects the whole batch, which is all or nothing
+		if(sscanf(entry, " %u, %u, %u", &pid, &period, &computation) != 3){
+			printk(KERN_ALERT "Malformed batch entry: %s\n", entry);
+			goto INVALID;
+		}
+		if(n == MP2_MAX_BATCH){
+			printk(KERN_ALERT "Batch registration exceeds %d tasks\n", MP2_MAX_BATCH);
+			goto INVALID;
+		}
+		batch[n] = mp2_alloc_task(pid, period, computation);
+		if(!batch[n]){
+			for(i = 0; i < n; i++) kmem_cache_free(mp2_cache, batch[i]);
+			return -ENOMEM;
+		}
+		n++;
+	}
+	if(!n) return -EINVAL;
+
+	//admitted tasks are added right away so later tasks are checked against them
 	mutex_lock(&task_struct_mutex);
+	for(i = 0; i < n; i++){
+		admitted[i] = !find_mp2_task_struct_by_pid_locked(batch[i]->pid);
+		for(j = 0; j < i && admitted[i]; j++){
+			admitted[i] = batch[j]->pid != batch[i]->pid;
+		}
+		if(admitted[i]){
+			admitted[i] = isAdmissible_locked(batch[i]->computation_ms, batch[i]->period_ms, NULL);
+			if(admitted[i]){
+				num_entries++;
+				spin_lock_bh(&sched_lock);
+				list_add(&(batch[i]->task_node), &head.task_node);
+				spin_unlock_bh(&sched_lock);
+			}
+		}
+		all_admitted &= admitted[i];
+	}
+
+	if(!all_admitted){
+		for(i = 0; i < n; i++){
+			if(admitted[i]){
+				num_entries--;
+				spin_lock_bh(&sched_lock);
+				list_del(&(batch[i]->task_node));
+				spin_unlock_bh(&sched_lock);
+			}
+		}
+	}
+
 	list_for_each(pos, &head.task_node){
-		mp2_task_struct * tmp = list_entry(pos, mp2_task_struct, task_node);
-		sum += tmp->computation_ms * 10000 / tmp->period_ms;
+		sum += task_utilization(list_entry(pos, mp2_task_struct, task_node));
 	}
 	mutex_unlock(&task_struct_mutex);
-	return sum <= 6930;
+
+	for(i = 0; i < n; i++){
+		offset += scnprintf(verdict + offset, verdict_len - offset, "PID:\t%u\t%s\n",
+				batch[i]->pid, admitted[i] ? "Admissible" : "Not admissible");
+	}
+	offset += scnprintf(verdict + offset, verdict_len - offset, "Batch:\t%s\tUtilization:\t%u.%04u\n",
+			all_admitted ? "Admitted" : "Rejected", sum / 10000, sum % 10000);
+
+	if(!all_admitted){
+		for(i = 0; i < n; i++) kmem_cache_free(mp2_cache, batch[i]);
+		return -EBUSY;
+	}
+	return 0;
+
+INVALID:
+	for(i = 0; i < n; i++) kmem_cache_free(mp2_cache, batch[i]);
+	return -EINVAL;
 }
 
 /**
  * @brief mp2_write - handler function for write. Called whenever a write is made
- * @param file - unused
+ * @param file - holds the verdict of the last batch registration on this file
  * @param buffer - buffer of write data from userspace
  * @param count - length of buffer
  * @param data - unused
- * @return number of bytes written
+ * @return number of bytes written, or a negative error if a batch was rejected
  */
 static ssize_t mp2_write(struct file *file, const char *buffer, size_t count, loff_t * data){
 	pid_t pid;
 	unsigned int period, computation;
+	unsigned int lock_id, cs;
 
 	struct list_head *pos, *q;
 
 	mp2_task_struct* tmp;
 
+	ssize_t ret;
+	int result;
+
 	//calculate buffer size
 	if ( count > PROCFS_MAX_SIZE )	{
 		procfs_buffer_size = PROCFS_MAX_SIZE;
@@ -206,24 +928,23 @@ static ssize_t mp2_write(struct file *file, const char *buffer, size_t count, lo
 	if ( copy_from_user(procfs_buffer, buffer, procfs_buffer_size) ) {
 		return -EFAULT;
 	}
+	ret = procfs_buffer_size;
 
 	switch (procfs_buffer[0]) {
 		case 'R': //Registration
 			sscanf(&procfs_buffer[2], "%u, %u, %u", &pid, &period, &computation);
 			if(isAdmissible(computation, period)){
-				tmp = (mp2_task_struct*)kmem_cache_alloc(mp2_cache, GFP_KERNEL);
-				tmp->pid = pid;
-				tmp->linux_task = find_task_by_pid(pid);
-				tmp->period_ms = period;
-				tmp->computation_ms = computation;
-				tmp->task_state = SLEEPING;
-				tmp->deadline_jiffies = 0;
-				setup_timer(&tmp->wakeup_timer, timer_callback, tmp->pid);
-				INIT_LIST_HEAD(&tmp->task_node);
+				tmp = mp2_alloc_task(pid, period, computation);
+				if(!tmp){
+					ret = -ENOMEM;
+					break;
+				}
 
 				mutex_lock(&task_struct_mutex);
 				num_entries++;
+				spin_lock_bh(&sched_lock);
 				list_add(&(tmp->task_node), &head.task_node);
+				spin_unlock_bh(&sched_lock);
 				mutex_unlock(&task_struct_mutex);
 
 //				printk(KERN_ALERT "Registering task with PID: %u Period: %u  Compute Time: %u\n", pid, period, computation);
@@ -231,30 +952,125 @@ static ssize_t mp2_write(struct file *file, const char *buffer, size_t count, lo
 				printk(KERN_ALERT "Job with PID: %u, computation time %u, period %u is not admissible.\n", pid, computation, period);
 			}
 			break;
+		case 'B': //Batch registration
+			kfree(file->private_data);
+			file->private_data = kzalloc(MP2_VERDICT_LINE * (MP2_MAX_BATCH + 1), GFP_KERNEL);
+			if(!file->private_data){
+				ret = -ENOMEM;
+				break;
+			}
+			procfs_buffer[procfs_buffer_size < PROCFS_MAX_SIZE ? procfs_buffer_size : PROCFS_MAX_SIZE - 1] = '\0';
+			result = mp2_register_batch(&procfs_buffer[2], file->private_data, MP2_VERDICT_LINE * (MP2_MAX_BATCH + 1));
+			if(result){
+				printk(KERN_ALERT "Batch registration rejected: %d\n", result);
+				ret = result;
+			}
+			break;
+		case 'M': //Mode change
+			sscanf(&procfs_buffer[2], "%u, %u, %u", &pid, &period, &computation);
+
+			//admission and the update happen under one lock so the task keeps its slot
+			mutex_lock(&task_struct_mutex);
+			tmp = find_mp2_task_struct_by_pid_locked(pid);
+			if(!tmp){
+				printk(KERN_ALERT "Received unknown PID in mode change: %u\n", pid);
+			} else if(!isAdmissible_locked(computation, period, tmp)){
+				printk(KERN_ALERT "Mode change of PID: %u to computation time %u, period %u is not admissible.\n", pid, computation, period);
+			} else if(!tmp->deadline_jiffies || use_deadline_backend){
+				//not released yet, or SCHED_DEADLINE applies it at the next replenishment
+				unsigned int old_period = tmp->period_ms, old_computation = tmp->computation_ms;
+				bool old_pending = tmp->mode_change_pending;
+
+				tmp->period_ms = period;
+				tmp->computation_ms = computation;
+				tmp->mode_change_pending = false;
+				result = tmp->dl_attached ? mp2_deadline_attach(tmp) : 0;
+				if(result){
+					//the kernel keeps the old runtime and deadline, so keep them here too
+					printk(KERN_ALERT "SCHED_DEADLINE rejected mode change of PID: %u\n", pid);
+					tmp->period_ms = old_period;
+					tmp->computation_ms = old_computation;
+					tmp->mode_change_pending = old_pending;
+					ret = result;
+				}
+				update_priority_locked(tmp);
+			} else {
+				spin_lock_bh(&sched_lock);
+				tmp->pending_period_ms = period;
+				tmp->pending_computation_ms = computation;
+				tmp->mode_change_pending = true;
+				spin_unlock_bh(&sched_lock);
+			}
+			//the ceilings of the locks the task uses follow its new period
+			if(tmp) update_lock_holders_locked(tmp);
+			mutex_unlock(&task_struct_mutex);
+			if(tmp && !use_deadline_backend)
+				mp2_dispatch();
+			break;
+		case 'L': //Lock declaration
+			sscanf(&procfs_buffer[2], "%u, %u, %u", &pid, &lock_id, &cs);
+			result = mp2_declare_lock(pid, lock_id, cs);
+			if(result) ret = result;
+			break;
+		case 'P': //Lock acquire
+			sscanf(&procfs_buffer[2], "%u, %u", &pid, &lock_id);
+			result = mp2_acquire_lock(pid, lock_id);
+			if(result) ret = result;
+			break;
+		case 'V': //Lock release
+			sscanf(&procfs_buffer[2], "%u, %u", &pid, &lock_id);
+			result = mp2_release_lock(pid, lock_id);
+			if(result) ret = result;
+			break;
 		case 'Y': //Yield
 			sscanf(&procfs_buffer[2], "%d", &pid);
 
 			tmp = find_mp2_task_struct_by_pid(pid);
 			if(!tmp) break;
-			mutex_lock_interruptible(&task_struct_mutex);
+
+			//the deadline backend throttles the task until its next period
+			if(use_deadline_backend){
+				mutex_lock(&task_struct_mutex);
+				if(!tmp->dl_attached){
+					result = mp2_deadline_attach(tmp);
+					if(result){
+						mutex_unlock(&task_struct_mutex);
+						printk(KERN_ALERT "SCHED_DEADLINE rejected PID: %u: %d\n", pid, result);
+						ret = result;
+						break;
+					}
+					tmp->dl_attached = true;
+					tmp->deadline_jiffies = jiffies + msecs_to_jiffies(tmp->period_ms);
+				}
+				mutex_unlock(&task_struct_mutex);
+				if(tmp->linux_task == current) yield();
+				break;
+			}
+
+			//the next task is picked and started right here
+			spin_lock_bh(&sched_lock);
 			tmp->task_state = SLEEPING;
 			if(!tmp->deadline_jiffies){
 				tmp->deadline_jiffies = jiffies + msecs_to_jiffies(tmp->period_ms);
 				mod_timer(&tmp->wakeup_timer, tmp->deadline_jiffies);
 			}
 //			printk(KERN_ALERT "Yielding: %u (%u %u)\n", tmp->pid, tmp->computation_ms, tmp->period_ms);
-			mutex_unlock(&task_struct_mutex);
-
-			mutex_lock_interruptible(&currently_running_task_mutex);
 			if(tmp == currently_running_task){
 				currently_running_task = NULL;
 			}
-			mutex_unlock(&currently_running_task_mutex);
-
-			wake_up_process(mp2_dispatch_task);
-
-			set_task_state(tmp->linux_task, TASK_UNINTERRUPTIBLE);
-			schedule();
+			pick_next_locked();
+			spin_unlock_bh(&sched_lock);
+
+			mp2_apply();
+
+			//sleep until dispatched; the state is checked after setting the
+			//task state so a release in between is not lost
+			if(tmp->linux_task == current){
+				set_current_state(TASK_UNINTERRUPTIBLE);
+				if(READ_ONCE(tmp->task_state) != RUNNING)
+					schedule();
+				__set_current_state(TASK_RUNNING);
+			}
 			break;
 		case 'D': //Deregistration
 			sscanf(&procfs_buffer[2], "%d", &pid);
@@ -264,21 +1080,27 @@ static ssize_t mp2_write(struct file *file, const char *buffer, size_t count, lo
 				mp2_task_struct * tmp = list_entry(pos, mp2_task_struct, task_node);
 				//Remove task from list.
 				if(tmp->pid == pid){
-					del_timer(&tmp->wakeup_timer);
+					del_timer_sync(&tmp->wakeup_timer);
+					remove_task_locks_locked(tmp);
+					mp2_deadline_detach(tmp);
 
 //					printk(KERN_ALERT "Removing task %u (%u %u)\n", tmp->pid, tmp->computation_ms, tmp->period_ms);
+					//dispatch_mutex keeps mp2_apply from using the task after it is freed
+					mutex_lock(&dispatch_mutex);
+					spin_lock_bh(&sched_lock);
 					list_del(pos);
-					kmem_cache_free(mp2_cache, tmp);
-					num_entries--;
-					mutex_lock(&currently_running_task_mutex);
 					if(tmp == currently_running_task){
 						currently_running_task = NULL;
 					}
-					mutex_unlock(&currently_running_task_mutex);
+					spin_unlock_bh(&sched_lock);
+					mutex_unlock(&dispatch_mutex);
+					kmem_cache_free(mp2_cache, tmp);
+					num_entries--;
 					break;
 				}
 			}
 			mutex_unlock(&task_struct_mutex);
+			if(!use_deadline_backend) mp2_dispatch();
 			break;
 		default:
 			printk(KERN_ALERT "Received unknown prefix in mp2_write\n");
@@ -286,19 +1108,19 @@ static ssize_t mp2_write(struct file *file, const char *buffer, size_t count, lo
 	}
 
 	memset(procfs_buffer, 0, procfs_buffer_size);
-	return procfs_buffer_size;
+	return ret;
 }
 
 /**
- * @brief mp2_schedule - handler function for dispatcher thread. Schedules the
- * highest priority ready task
+ * @brief mp2_schedule - handler function for dispatcher thread. Applies the
+ * decisions made by the release timers, which can not change scheduling
+ * policies themselves. Yields and lock releases dispatch directly. The thread
+ * runs under SCHED_FIFO above the tasks so it runs as soon as it is woken.
  * @param data - unused
  * @return 0 when finished
  */
 int mp2_schedule(void * data) {
-	mp2_task_struct *tmp, *next;
-	struct list_head *pos;
-	unsigned int shortest_relative_period;
+	mp2_task_struct *tmp;
 
 	while(1){
 		//sleep
@@ -310,65 +1132,53 @@ int mp2_schedule(void * data) {
 		//check to see if thread was shutdown
 		if(kthread_should_stop()){
 			printk(KERN_ALERT "Stopping dispatch kthread\n");
-			mutex_lock(&currently_running_task_mutex);
+			mutex_lock(&dispatch_mutex);
+			spin_lock_bh(&sched_lock);
 			if(currently_running_task){ //deschedule current task
 				printk(KERN_ALERT "Descheduling current running task\n");
 				currently_running_task->task_state = SLEEPING;
-				sched_setscheduler(currently_running_task->linux_task, SCHED_NORMAL, &sparam_normal);
 			}
-			mutex_unlock(&currently_running_task_mutex);
-			return 0;
-		}
-
-		//setup variables
-		next = NULL;
-		shortest_relative_period  = 0;
-
-		//find next task to schedule
-		mutex_lock(&task_struct_mutex);
-		list_for_each(pos, &head.task_node){
-			tmp = list_entry(pos, mp2_task_struct, task_node);
-			if((tmp->task_state == READY) &&(tmp->period_ms < shortest_relative_period || !next)){
-				shortest_relative_period = tmp->period_ms;
-				next = tmp;
+			currently_running_task = NULL;
+			spin_unlock_bh(&sched_lock);
+
+			//no task can be added or removed while the module unloads
+			list_for_each_entry(tmp, &head.task_node, task_node){
+				if(tmp->fifo){
+					sched_setscheduler(tmp->linux_task, SCHED_NORMAL, &sparam_normal);
+					tmp->fifo = false;
+				}
 			}
+			mutex_unlock(&dispatch_mutex);
+			return 0;
 		}
-		mutex_unlock(&task_struct_mutex);
 
-		//preempt/deschedule current task
-		mutex_lock(&currently_running_task_mutex);
-		if(currently_running_task && next){
-			if(next->computation_ms < currently_running_task->computation_ms){ //preemption
-//				printk(KERN_ALERT "Task %u (%u %u) is preempting task %u (%u %u)\n", next->pid, next->computation_ms, next->period_ms, currently_running_task->pid, currently_running_task->computation_ms, currently_running_task->period_ms);
-				currently_running_task->task_state = READY;
-				sched_setscheduler(currently_running_task->linux_task, SCHED_NORMAL, &sparam_normal);
-				set_task_state(currently_running_task->linux_task, TASK_UNINTERRUPTIBLE);
-
-				next->task_state = RUNNING;
-				wake_up_process(next->linux_task);
-				sched_setscheduler(next->linux_task, SCHED_FIFO, &sparam_fifo);
-				currently_running_task = next;
-			}
-		} else if (next){
-//			printk(KERN_ALERT "Scheduling %u (%u %u)\n", next->pid, next->computation_ms, next->period_ms);
-			next->task_state = RUNNING;
-			wake_up_process(next->linux_task);
-			sched_setscheduler(next->linux_task, SCHED_FIFO, &sparam_fifo);
-			currently_running_task = next;
-		}
-		mutex_unlock(&currently_running_task_mutex);
+		mp2_apply();
 	}
 
 	return 0;
 }
 
+/**
+ * @brief mp2_release - handler function for release. Frees any batch verdict
+ * that was not read.
+ * @param inode - unused
+ * @param file - the file being closed
+ * @return 0
+ */
+static int mp2_release(struct inode *inode, struct file *file){
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
+
 /**
  * @brief associates file actions to their respective handlers
  */
 static const struct file_operations mp2_file = {
 		.owner = THIS_MODULE,
 		.read = mp2_read,
-		.write = mp2_write
+		.write = mp2_write,
+		.release = mp2_release
 };
 
 /**
@@ -386,7 +1196,7 @@ int __init mp2_init(void)
 
 	//create a mutex
 	mutex_init(&task_struct_mutex);
-	mutex_init(&currently_running_task_mutex);
+	mutex_init(&dispatch_mutex);
 
 	//init list
 	num_entries = 0;
@@ -396,16 +1206,22 @@ int __init mp2_init(void)
 	mp2_cache = kmem_cache_create("mp2_cache", sizeof(mp2_task_struct), 0, SLAB_HWCACHE_ALIGN, NULL);
 
 	//initialize currently running task to NULL
-	mutex_lock(&currently_running_task_mutex);
 	currently_running_task = NULL;
-	mutex_unlock(&currently_running_task_mutex);
 
-	//scheduling params
-	sparam_fifo.sched_priority = 99;
+	//scheduling params, the dispatcher must be able to preempt the tasks
+	sparam_dispatch.sched_priority = MAX_RT_PRIO - 1;
+	sparam_fifo.sched_priority = MAX_RT_PRIO - 2;
 	sparam_normal.sched_priority = 0;
 
-	//dispatch thread
-	mp2_dispatch_task = kthread_run(mp2_schedule, NULL, "mp2_dispatch_thread");
+	//dispatch thread, not needed when SCHED_DEADLINE does the dispatching
+	use_deadline_backend = !strcmp(backend, "deadline");
+	mp2_dispatch_task = NULL;
+	if(use_deadline_backend){
+		printk(KERN_ALERT "MP2 using SCHED_DEADLINE backend\n");
+	} else {
+		mp2_dispatch_task = kthread_run(mp2_schedule, NULL, "mp2_dispatch_thread");
+		sched_setscheduler(mp2_dispatch_task, SCHED_FIFO, &sparam_dispatch);
+	}
 
 	printk(KERN_ALERT "MP2 MODULE LOADED\n");
 	return 0;
@@ -426,14 +1242,23 @@ void __exit mp2_exit(void)
 	proc_remove(proc_entry);
 	proc_remove(proc_dir);
 
+	//stop the release timers before the kernel thread they wake
+	mutex_lock(&task_struct_mutex);
+	list_for_each_entry(tmp, &head.task_node, task_node){
+		del_timer_sync(&tmp->wakeup_timer);
+	}
+	mutex_unlock(&task_struct_mutex);
+
 	//stop kernel thread
-	kthread_stop(mp2_dispatch_task);
+	if(mp2_dispatch_task)
+		kthread_stop(mp2_dispatch_task);
 
 	//cleanup task list
 	mutex_lock(&task_struct_mutex);
 	list_for_each_safe(pos, q, &head.task_node){
 		tmp = list_entry(pos, mp2_task_struct, task_node);
-		del_timer(&tmp->wakeup_timer);
+		remove_task_locks_locked(tmp);
+		mp2_deadline_detach(tmp);
 		list_del(pos);
 		kmem_cache_free(mp2_cache, tmp);
 	}
@@ -441,7 +1266,7 @@ void __exit mp2_exit(void)
 	kmem_cache_destroy(mp2_cache);
 
 	mutex_destroy(&task_struct_mutex);
-	mutex_destroy(&currently_running_task_mutex);
+	mutex_destroy(&dispatch_mutex);
 
 	printk(KERN_ALERT "MP2 MODULE UNLOADED\n");
 }
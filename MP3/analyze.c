@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mp3_shared.h"
+#include "mp3_stream.h"
+
+#define DEFAULT_HZ 250   // Jiffies per second of the profiled kernel, the 50ms samples are 13 jiffies apart
+#define MAX_FIELDS 8   // The max number of numbers on one line of a text profile
+#define MAX_RUNS 1024   // The max number of files analyzed per invocation
+
+// One profile in columnar form, one entry per record
+struct columns {
+  size_t n, cap;
+  uint64_t *jiffies;
+  uint32_t *pid;
+  uint64_t *min_flt;
+  uint64_t *maj_flt;
+  uint64_t *cpu_time;
+  uint64_t *time_ns;   // 0 in profiles of modules before version 7
+  uint64_t *jitter_ns;
+};
+
+// The results of one profile, used for the thrashing curve
+struct run {
+  const char *name;
+  int nprocs;   // number of processes of the run, -1 if unknown
+  double seconds;
+  double util;   // cpu time over wall time, in percent
+  double min_rate;   // minor faults per second
+  double maj_rate;   // major faults per second
+};
+
+static struct run runs[MAX_RUNS];
+static int nruns;
+
+static unsigned hz = DEFAULT_HZ;
+static unsigned bucket_ms;
+static const char *csv_prefix;
+
+// This function appends one record to the columns.
+void col_append(struct columns *c, uint64_t jiffies, uint32_t pid, uint64_t min_flt, uint64_t maj_flt, uint64_t cpu_time,
+                uint64_t time_ns, uint64_t jitter_ns)
+{
+  if(c->n == c->cap){
+    c->cap = c->cap ? c->cap * 2 : 4096;
+    c->jiffies = realloc(c->jiffies, c->cap * sizeof(uint64_t));
+    c->pid = realloc(c->pid, c->cap * sizeof(uint32_t));
+    c->min_flt = realloc(c->min_flt, c->cap * sizeof(uint64_t));
+    c->maj_flt = realloc(c->maj_flt, c->cap * sizeof(uint64_t));
+    c->cpu_time = realloc(c->cpu_time, c->cap * sizeof(uint64_t));
+    c->time_ns = realloc(c->time_ns, c->cap * sizeof(uint64_t));
+    c->jitter_ns = realloc(c->jitter_ns, c->cap * sizeof(uint64_t));
+    if(!c->jiffies || !c->pid || !c->min_flt || !c->maj_flt || !c->cpu_time || !c->time_ns || !c->jitter_ns){
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  c->jiffies[c->n] = jiffies;
+  c->pid[c->n] = pid;
+  c->min_flt[c->n] = min_flt;
+  c->maj_flt[c->n] = maj_flt;
+  c->cpu_time[c->n] = cpu_time;
+  c->time_ns[c->n] = time_ns;
+  c->jitter_ns[c->n] = jitter_ns;
+  c->n++;
+}
+
+// One record while the columns are sorted
+struct col_row {
+  uint64_t jiffies, min_flt, maj_flt, cpu_time, time_ns, jitter_ns;
+  uint32_t pid;
+};
+
+// This function orders records by jiffies and then by time.
+int cmp_row(const void *a, const void *b)
+{
+  const struct col_row *x = a, *y = b;
+
+  if(x->jiffies != y->jiffies)
+    return x->jiffies < y->jiffies ? -1 : 1;
+  return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+// This function sorts the records from start to the end of the columns by time.
+void col_sort(struct columns *c, size_t start)
+{
+  struct col_row *rows;
+  size_t i, n = c->n - start;
+
+  if(n < 2)
+    return;
+  rows = malloc(n * sizeof(*rows));
+  for(i=0; i<n; i++){
+    rows[i].jiffies = c->jiffies[start + i];
+    rows[i].pid = c->pid[start + i];
+    rows[i].min_flt = c->min_flt[start + i];
+    rows[i].maj_flt = c->maj_flt[start + i];
+    rows[i].cpu_time = c->cpu_time[start + i];
+    rows[i].time_ns = c->time_ns[start + i];
+    rows[i].jitter_ns = c->jitter_ns[start + i];
+  }
+  qsort(rows, n, sizeof(*rows), cmp_row);
+  for(i=0; i<n; i++){
+    c->jiffies[start + i] = rows[i].jiffies;
+    c->pid[start + i] = rows[i].pid;
+    c->min_flt[start + i] = rows[i].min_flt;
+    c->maj_flt[start + i] = rows[i].maj_flt;
+    c->cpu_time[start + i] = rows[i].cpu_time;
+    c->time_ns[start + i] = rows[i].time_ns;
+    c->jitter_ns[start + i] = rows[i].jitter_ns;
+  }
+  free(rows);
+}
+
+// This function frees the columns.
+void col_free(struct columns *c)
+{
+  free(c->jiffies);
+  free(c->pid);
+  free(c->min_flt);
+  free(c->maj_flt);
+  free(c->cpu_time);
+  free(c->time_ns);
+  free(c->jitter_ns);
+  memset(c, 0, sizeof(*c));
+}
+
+// This function converts the 8 bytes at p to a number if they are all digits, with a few multiplications on the
+// whole word instead of one per digit, and returns -1 otherwise. Numbers in the profiles are mostly long enough
+// (jiffies, nanoseconds) that this is where the parser saves most of its time.
+static inline int64_t parse8(const char *p)
+{
+  uint64_t w;
+
+  memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // every byte is 0x30-0x39: its high nibble is 3 and adding 6 does not carry into it
+  if(((w & 0xf0f0f0f0f0f0f0f0ull) | (((w + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4)) != 0x3333333333333333ull)
+    return -1;
+  w -= 0x3030303030303030ull;
+  w = w * 10 + (w >> 8);   // pairs of digits in every other byte
+  w = ((w & 0x000000ff000000ffull) * (100 + (1000000ull << 32)) +
+       ((w >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32))) >> 32;
+  return w;
+#else
+  (void)w;
+  return -1;
+#endif
+}
+
+// This function parses one line of a text profile into vals in a single pass, converting the numbers while it
+// looks for the end of the line. A line that holds anything but digits, blanks and minus signs (the jitter of the
+// monitor output is signed) is a header or a summary: the parser stops there and skips to the next line. It sets
+// *next to the start of the next line and returns the number of numbers, or -1 if the line is skipped. Negative
+// numbers are stored as 0 and flagged in the bits of *neg.
+int parse_line(const char *p, const char *end, const char **next, uint64_t *vals, unsigned *neg)
+{
+  int n = 0, minus = 0;
+  int64_t w;
+  uint64_t v;
+  unsigned d;
+
+  *neg = 0;
+  while(p < end){
+    d = (unsigned char)*p - '0';
+    if(d > 9){
+      if(*p == '\n'){
+        *next = p + 1;
+        return n;
+      }
+      minus = *p == '-';
+      if(!minus && *p != ' ' && *p != '\t' && *p != '\r')
+        break;
+      p++;
+      continue;
+    }
+    if(n == MAX_FIELDS)
+      break;
+    v = 0;
+    while(end - p >= 8 && (w = parse8(p)) >= 0){
+      v = v * 100000000 + w;
+      p += 8;
+    }
+    for(; p < end && (d = (unsigned char)*p - '0') <= 9; p++)
+      v = v * 10 + d;
+    if(minus){
+      *neg |= 1u << n;
+      v = 0;
+    }
+    vals[n++] = v;
+  }
+  if(p == end){
+    *next = end;
+    return n;
+  }
+  p = memchr(p, '\n', end - p);
+  *next = p ? p + 1 : end;
+  return -1;
+}
+
+// This function loads a text profile. Lines of 4 numbers are the original format "jiffies minor major cpu"
+// of one aggregate sample, lines of 5, 6 or 8 numbers are monitor output "jiffies pid minor major cpu [wss [time_ns jitter_ns]]".
+// Only the jitter may be negative, and it is clamped to 0 like load_stream does. Anything else is skipped.
+void load_text(const char *buf, size_t len, struct columns *c)
+{
+  const char *p = buf, *end = buf + len;
+  uint64_t vals[MAX_FIELDS];
+  unsigned neg;
+  int n;
+
+  while(p < end){
+    n = parse_line(p, end, &p, vals, &neg);
+    if(neg && !(n == 8 && neg == 1u << 7))
+      continue;
+    if(n == 4)
+      col_append(c, vals[0], MP3_AGGREGATE_PID, vals[1], vals[2], vals[3], 0, 0);
+    else if(n == 5 || n == 6)
+      col_append(c, vals[0], vals[1], vals[2], vals[3], vals[4], 0, 0);
+    else if(n == 8)
+      col_append(c, vals[0], vals[1], vals[2], vals[3], vals[4], vals[6], vals[7]);
+  }
+}
+
+// This function loads a binary stream written by monitor -c, and returns -1 if it is truncated.
+int load_stream(const void *buf, size_t len, struct columns *c, const char *name)
+{
+  static struct stream_reader r;
+  union stream_record rec;
+  unsigned long controls = 0;
+  int ret;
+
+  stream_open(&r, buf, len);
+  while((ret = stream_next(&r, &rec)) > 0){
+    if(rec.hdr.type == MP3_RECORD_TASK || rec.hdr.type == MP3_RECORD_AGGREGATE)
+      col_append(c, rec.hdr.jiffies, rec.hdr.pid, rec.task.min_flt, rec.task.maj_flt, rec.task.cpu_time,
+                 rec.hdr.time_ns, rec.hdr.jitter_ns > 0 ? rec.hdr.jitter_ns : 0);
+    else if(rec.hdr.type == MP3_RECORD_CONTROL)
+      controls++;
+  }
+  if(controls)
+    printf("%s: %lu thrashing control decisions, see monitor -d\n", name, controls);
+  if(r.lost)
+    printf("%s: %llu records were lost while collecting\n", name, (unsigned long long)r.lost);
+  return ret;
+}
+
+// This function loads an archive of raw records written by monitor -x. Its records are in runs of one cpu at a
+// time, so they are sorted by time before they are turned into samples.
+void load_raw(const void *buf, size_t len, struct columns *c, const char *name)
+{
+  struct raw_reader r;
+  struct mp3_record_header *rec;
+  union stream_record conv;
+  struct mp3_task_record *task;
+  unsigned long controls = 0;
+  size_t start = c->n;
+  int truncated;
+
+  raw_open(&r, buf, len);
+  while((rec = raw_next(&r, &conv, &truncated))){
+    if(rec->type == MP3_RECORD_TASK || rec->type == MP3_RECORD_AGGREGATE){
+      task = (struct mp3_task_record *)rec;
+      col_append(c, rec->jiffies, rec->pid, task->min_flt, task->maj_flt, task->cpu_time,
+                 rec->time_ns, rec->jitter_ns > 0 ? rec->jitter_ns : 0);
+    } else if(rec->type == MP3_RECORD_CONTROL)
+      controls++;
+  }
+  col_sort(c, start);
+  if(controls)
+    printf("%s: %lu thrashing control decisions, see monitor -d\n", name, controls);
+  if(truncated)
+    printf("%s: truncated record at the end\n", name);
+}
+
+// This function maps a profile and loads it, in whichever format it is.
+int load(const char *name, struct columns *c)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st)){
+    perror(name);
+    return -1;
+  }
+  if(!st.st_size){
+    close(fd);
+    return 0;
+  }
+  map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    perror(name);
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  if(st.st_size >= STREAM_HEADER_SIZE && !memcmp(map, STREAM_MAGIC, 4)){
+    if(((unsigned char *)map)[4] != STREAM_VERSION)
+      printf("%s: stream version %d, expected %d\n", name, ((unsigned char *)map)[4], STREAM_VERSION);
+    else if(load_stream(map, st.st_size, c, name) < 0)
+      printf("%s: truncated entry at the end\n", name);
+  } else if(st.st_size >= RAW_HEADER_SIZE && !memcmp(map, RAW_MAGIC, 4)){
+    load_raw(map, st.st_size, c, name);
+  } else {
+    load_text(map, st.st_size, c);
+  }
+  munmap(map, st.st_size);
+  return 0;
+}
+
+// This function turns the records into one sample per timestamp, in place. If the profile has aggregate records
+// they are used as they are, otherwise the per-task records of every timestamp are summed. A summed sample keeps
+// the time and jitter of its first record, when the round started sampling.
+void to_samples(struct columns *c)
+{
+  size_t i, n = 0;
+  int has_aggregate = 0;
+
+  for(i=0; i<c->n; i++)
+    if(c->pid[i] == MP3_AGGREGATE_PID){
+      has_aggregate = 1;
+      break;
+    }
+
+  // a sample never lands after the record it is built from, so the columns are compacted as they are read
+  for(i=0; i<c->n; i++){
+    if(has_aggregate && c->pid[i] != MP3_AGGREGATE_PID)
+      continue;
+    if(n && c->jiffies[n - 1] == c->jiffies[i]){
+      c->min_flt[n - 1] += c->min_flt[i];
+      c->maj_flt[n - 1] += c->maj_flt[i];
+      c->cpu_time[n - 1] += c->cpu_time[i];
+      continue;
+    }
+    c->jiffies[n] = c->jiffies[i];
+    c->pid[n] = MP3_AGGREGATE_PID;
+    c->min_flt[n] = c->min_flt[i];
+    c->maj_flt[n] = c->maj_flt[i];
+    c->cpu_time[n] = c->cpu_time[i];
+    c->time_ns[n] = c->time_ns[i];
+    c->jitter_ns[n] = c->jitter_ns[i];
+    n++;
+  }
+  c->n = n;
+}
+
+// This function sums a column.
+uint64_t col_sum(const uint64_t *v, size_t n)
+{
+  uint64_t sum = 0;
+  size_t i;
+
+  for(i=0; i<n; i++)
+    sum += v[i];
+  return sum;
+}
+
+// This function moves the k-th smallest value of v to v[k], the smaller ones before it and the larger ones after
+// it, and returns it. Quickselect with the median of three as pivot takes linear time on average, where sorting the
+// column took most of the time of a large profile.
+uint64_t select_u64(uint64_t *v, size_t n, size_t k)
+{
+  long lo = 0, hi = n - 1, i, j, mid;
+  uint64_t pivot, t;
+
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(v[mid] < v[lo]){ t = v[mid]; v[mid] = v[lo]; v[lo] = t; }
+    if(v[hi] < v[lo]){ t = v[hi]; v[hi] = v[lo]; v[lo] = t; }
+    if(v[hi] < v[mid]){ t = v[hi]; v[hi] = v[mid]; v[mid] = t; }
+    pivot = v[mid];
+    // Hoare partition: v[lo..j] <= pivot <= v[i..hi]
+    i = lo;
+    j = hi;
+    while(i <= j){
+      while(v[i] < pivot)
+        i++;
+      while(v[j] > pivot)
+        j--;
+      if(i <= j){
+        t = v[i]; v[i] = v[j]; v[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if((long)k <= j)
+      hi = j;
+    else if((long)k >= i)
+      lo = i;
+    else
+      break;
+  }
+  return v[k];
+}
+
+// This function returns the nearest rank of a percentile of n values, counted from 0.
+size_t percentile_rank(size_t n, double p)
+{
+  size_t rank = (size_t)(p / 100.0 * n + 0.5);
+  if(rank < 1) rank = 1;
+  if(rank > n) rank = n;
+  return rank - 1;
+}
+
+// This function prints the percentiles of a column, and reorders it in place. Every percentile is selected
+// among the values below the next higher one, so the column is only partitioned, never sorted.
+void print_percentiles(const char *what, uint64_t *v, size_t n)
+{
+  size_t r50 = percentile_rank(n, 50), r90 = percentile_rank(n, 90), r99 = percentile_rank(n, 99), i;
+  uint64_t p50, p90, p99, max = 0;
+
+  for(i=0; i<n; i++)
+    if(v[i] > max)
+      max = v[i];
+  p99 = select_u64(v, n, r99);
+  p90 = select_u64(v, r99 + 1, r90);
+  p50 = select_u64(v, r90 + 1, r50);
+  printf("  %-18s p50 %-10llu p90 %-10llu p99 %-10llu max %llu\n", what,
+         (unsigned long long)p50, (unsigned long long)p90, (unsigned long long)p99, (unsigned long long)max);
+}
+
+// This function writes the fault rate and utilization time series of a profile to a csv file, one line per
+// bucket of bucket_ms (one line per sample if bucket_ms is 0), with the cumulative fault counts.
+void write_series(const char *name, struct columns *s)
+{
+  char path[4096];
+  const char *base = strrchr(name, '/');
+  uint64_t bucket = (uint64_t)bucket_ms * hz / 1000;
+  uint64_t start, min_flt = 0, maj_flt = 0, cpu = 0, cum_min = 0, cum_maj = 0, width;
+  size_t i;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s%s.csv", csv_prefix, base ? base + 1 : name);
+  f = fopen(path, "w");
+  if(!f){
+    perror(path);
+    return;
+  }
+  fprintf(f, "time_s,minor,major,cumulative_minor,cumulative_major,minor_per_s,major_per_s,cpu_util_percent\n");
+  if(!bucket)
+    bucket = 1;
+  start = s->jiffies[0];
+  for(i=0; i<=s->n; i++){
+    if(i == s->n || s->jiffies[i] >= start + bucket){
+      // a bucket covers at least one sample interval, so sparse samples do not show up as bursts
+      width = i < s->n ? s->jiffies[i] - start : (i > 1 ? s->jiffies[i - 1] - s->jiffies[i - 2] : 1);
+      if(!width)
+        width = 1;
+      cum_min += min_flt;
+      cum_maj += maj_flt;
+      fprintf(f, "%.3f,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f\n", (double)(start - s->jiffies[0]) / hz,
+              (unsigned long long)min_flt, (unsigned long long)maj_flt,
+              (unsigned long long)cum_min, (unsigned long long)cum_maj,
+              (double)min_flt * hz / width, (double)maj_flt * hz / width, 100.0 * cpu / width);
+      if(i == s->n)
+        break;
+      start = s->jiffies[i];
+      min_flt = maj_flt = cpu = 0;
+    }
+    min_flt += s->min_flt[i];
+    maj_flt += s->maj_flt[i];
+    cpu += s->cpu_time[i];
+  }
+  fclose(f);
+}
+
+// This function returns the number of processes of a run from its file name, as in the n<N>-<run>.data files
+// of the case study, or -1 if the name does not say.
+int procs_of(const char *name)
+{
+  const char *base = strrchr(name, '/');
+  int n;
+
+  base = base ? base + 1 : name;
+  if(sscanf(base, "n%d-", &n) == 1 && n > 0)
+    return n;
+  return -1;
+}
+
+// This function analyzes one profile and prints its totals, rates and percentiles.
+void analyze(const char *name)
+{
+  struct columns s;
+  uint64_t dt, min_total, maj_total, cpu_total, *deltas;
+  double seconds, interval_ms;
+  size_t i;
+  int timed;
+  struct run *r;
+
+  memset(&s, 0, sizeof(s));
+  if(load(name, &s))
+    return;
+  to_samples(&s);
+  if(s.n < 2){
+    printf("%s: not enough samples\n", name);
+    col_free(&s);
+    return;
+  }
+
+  // the duration includes the interval of the first sample, taken as the median interval. Profiles of version 7
+  // modules are timed in nanoseconds, older ones only in jiffies.
+  timed = s.time_ns[0] != 0;
+  deltas = malloc((s.n - 1) * sizeof(uint64_t));
+  for(i=1; i<s.n; i++)
+    deltas[i - 1] = timed ? s.time_ns[i] - s.time_ns[i - 1] : s.jiffies[i] - s.jiffies[i - 1];
+  dt = select_u64(deltas, s.n - 1, (s.n - 1) / 2);
+  free(deltas);
+  if(timed){
+    seconds = (double)(s.time_ns[s.n - 1] - s.time_ns[0] + dt) / 1e9;
+    interval_ms = dt / 1e6;
+  } else {
+    seconds = (double)(s.jiffies[s.n - 1] - s.jiffies[0] + dt) / hz;
+    interval_ms = 1000.0 * dt / hz;
+  }
+
+  min_total = col_sum(s.min_flt, s.n);
+  maj_total = col_sum(s.maj_flt, s.n);
+  cpu_total = col_sum(s.cpu_time, s.n);
+
+  if(nruns < MAX_RUNS){
+    r = &runs[nruns++];
+    r->name = name;
+    r->nprocs = procs_of(name);
+    r->seconds = seconds;
+    r->util = 100.0 * cpu_total / (seconds * hz);
+    r->min_rate = min_total / seconds;
+    r->maj_rate = maj_total / seconds;
+  }
+
+  if(csv_prefix)
+    write_series(name, &s);
+
+  printf("%s: %zu samples over %.2fs, every %.1fms\n", name, s.n, seconds, interval_ms);
+  printf("  minor faults %-12llu %.1f/s\n", (unsigned long long)min_total, min_total / seconds);
+  printf("  major faults %-12llu %.1f/s\n", (unsigned long long)maj_total, maj_total / seconds);
+  printf("  cpu utilization %.1f%%\n", 100.0 * cpu_total / (seconds * hz));
+  print_percentiles("minor per sample", s.min_flt, s.n);
+  print_percentiles("major per sample", s.maj_flt, s.n);
+  print_percentiles("cpu per sample", s.cpu_time, s.n);
+  if(timed)
+    print_percentiles("sample jitter ns", s.jitter_ns, s.n);
+  col_free(&s);
+}
+
+// This function orders runs by number of processes.
+int cmp_run(const void *a, const void *b)
+{
+  const struct run *x = a, *y = b;
+  return x->nprocs - y->nprocs;
+}
+
+// This function prints the thrashing curve: the mean utilization and fault rates of the runs with the same number
+// of processes, in increasing number of processes. When the utilization stops growing with more processes while
+// the major fault rate climbs, the system is thrashing.
+void print_thrashing()
+{
+  char path[4096];
+  FILE *f = NULL;
+  int i, j, k;
+  double util, min_rate, maj_rate;
+
+  qsort(runs, nruns, sizeof(runs[0]), cmp_run);
+  if(csv_prefix){
+    snprintf(path, sizeof(path), "%sthrashing.csv", csv_prefix);
+    f = fopen(path, "w");
+    if(!f)
+      perror(path);
+    else
+      fprintf(f, "processes,runs,cpu_util_percent,minor_per_s,major_per_s\n");
+  }
+
+  printf("\n%-10s %-6s %-10s %-12s %s\n", "processes", "runs", "util(%)", "minor/s", "major/s");
+  for(i=0; i<nruns; i=j){
+    if(runs[i].nprocs < 0){
+      printf("%s: number of processes unknown, name it n<processes>-<run>\n", runs[i].name);
+      j = i + 1;
+      continue;
+    }
+    util = min_rate = maj_rate = 0;
+    for(j=i; j<nruns && runs[j].nprocs == runs[i].nprocs; j++){
+      util += runs[j].util;
+      min_rate += runs[j].min_rate;
+      maj_rate += runs[j].maj_rate;
+    }
+    k = j - i;
+    printf("%-10d %-6d %-10.1f %-12.1f %.1f\n", runs[i].nprocs, k, util / k, min_rate / k, maj_rate / k);
+    if(f)
+      fprintf(f, "%d,%d,%.2f,%.2f,%.2f\n", runs[i].nprocs, k, util / k, min_rate / k, maj_rate / k);
+  }
+  if(f)
+    fclose(f);
+}
+
+// Usage: ./analyze [-z hz] [-b bucket ms] [-o csv prefix] [-t] profile...
+// Every profile is a text profile (the MP3/data files or monitor output) or a stream written by monitor -c.
+int main(int argc, char* argv[])
+{
+  int opt, thrashing = 0;
+
+  while((opt = getopt(argc, argv, "z:b:o:t")) != -1){
+    switch(opt){
+      case 'z':
+        hz = atoi(optarg);
+        break;
+      case 'b':
+        bucket_ms = atoi(optarg);
+        break;
+      case 'o':
+        csv_prefix = optarg;
+        break;
+      case 't':
+        thrashing = 1;
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if(optind >= argc || !hz){
+    printf("Usage: %s [-z hz] [-b bucket ms] [-o csv prefix] [-t] profile...\n", argv[0]);
+    printf("  -z  jiffies per second of the profiled kernel (%d)\n", DEFAULT_HZ);
+    printf("  -b  write the time series in buckets of this many ms instead of one line per sample\n");
+    printf("  -o  write the time series of every profile to <prefix><profile>.csv\n");
+    printf("  -t  print the thrashing curve over profiles named n<processes>-<run>\n");
+    return 2;
+  }
+
+  for(; optind<argc; optind++)
+    analyze(argv[optind]);
+  if(thrashing)
+    print_thrashing();
+  return 0;
+}
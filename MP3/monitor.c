@@ -1,3 +1,4 @@
+#define _GNU_SOURCE   // splice()
 #include <stdio.h>
 #include <sys/syscall.h>
 #include <unistd.h>
@@ -8,25 +9,117 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
 
-#define NPAGES (128)   // The size of profiler buffer (Unit: memory page)
-#define BUFD_MAX 48000 // The max number of profiled samples stored in the profiler buffer
+#include "mp3_shared.h"
+#include "mp3_stream.h"
+
+#define MAX_PIDS 256   // The max number of tasks summarized per run
+#define MAX_REGIONS 256   // The max number of VMAs summarized per run
+#define MAX_RINGS 1024   // The max number of per-cpu rings merged
+#define TOP_REGIONS 10   // The number of hottest VMAs printed in the summary
+#define OUT_BUF_SIZE (1 << 20)   // Bytes buffered by the collector before each write to disk
+#define RAW_SPLICE_SIZE (1 << 20)   // Bytes asked from the module per splice
+
+// Per-task totals used to attribute faults to processes
+struct pid_summary {
+  unsigned pid;
+  unsigned long samples;
+  unsigned long long min_flt;
+  unsigned long long maj_flt;
+  unsigned long long cpu_time;
+  unsigned long long wss_pages;
+  unsigned long long wss_max;
+  unsigned long long fields;
+  unsigned long long rss_pages;
+  unsigned long long rss_max;
+  unsigned long long swap_max;
+  unsigned long long thp_pages;
+  unsigned long long numa_local;
+  unsigned long long numa_remote;
+};
+
+static struct pid_summary summary[MAX_PIDS];
+static int nsummary;
+
+// Per-VMA fault histograms summed over the run
+struct region_summary {
+  unsigned pid;
+  unsigned kind;
+  unsigned long long vm_start;
+  unsigned long long vm_end;
+  unsigned long long bucket_size;
+  unsigned long long faults;
+  unsigned long long buckets[MP3_HEAT_BUCKETS];
+};
+
+static struct region_summary regions[MAX_REGIONS];
+static int nregions;
+
+static const char *heat_kinds[] = { "anon", "file", "heap", "stack" };
+
+// Decisions of the thrashing controller, counted per action
+static const char *control_actions[] = { "suspend", "resume" };
+static unsigned long controls[2];
+
+// Bases of the deltas of the stream written by the collector
+static struct stream_table out_table;
+
+static unsigned char out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+static unsigned long long out_total;
+static int out_fd = -1;
+
+static volatile sig_atomic_t stop;
+
+// Read position of every ring while draining
+struct ring_cursor {
+  struct mp3_ring_header *ring;
+  unsigned char *data;
+  unsigned long long consumer;
+  unsigned long long producer;
+};
+
+static struct ring_cursor cursors[MAX_RINGS];
 
 static int buf_fd = -1;
 static int buf_len;
 
 // This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. If the operations are successful, the base address of memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
+// The header page is mapped first to find the size of the whole buffer, which depends on how the module was loaded
+// and on the number of cpus.
 void *buf_init(char *fname)
 {
-  unsigned int *kadr;
+  struct mp3_buffer_header *kadr;
 
   if(buf_fd == -1){
-    buf_len = NPAGES * getpagesize();
     if ((buf_fd=open(fname, O_RDWR|O_SYNC))<0){
         printf("file open error. %s\n", fname);
         return NULL;
     }
   }
+  buf_len = getpagesize();
+  kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
+  if (kadr == MAP_FAILED){
+      printf("buf file open error.\n");
+      return NULL;
+  }
+  // version 5 only differs in its shorter task records, which task_record reads, and versions 5 and 6 in
+  // their shorter record headers, which drain converts
+  if (kadr->magic != MP3_MAGIC || kadr->version < 5 || kadr->version > MP3_VERSION || kadr->nr_rings > MAX_RINGS){
+      printf("%s is not a version 5 to %d MP3 profiler buffer\n", fname, MP3_VERSION);
+      munmap(kadr, buf_len);
+      return NULL;
+  }
+
+  buf_len = kadr->data_offset + kadr->nr_rings * kadr->ring_stride;
+  munmap(kadr, getpagesize());
   kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
   if (kadr == MAP_FAILED){
       printf("buf file open error.\n");
@@ -45,47 +138,746 @@ void buf_exit()
   }
 }
 
+// This function returns a task record in the current layout. Records written by older modules are shorter, so they
+// are copied into buf with the missing fields zeroed; records in the current layout or newer are used in place.
+struct mp3_task_record *task_record(struct mp3_record_header *rec, struct mp3_task_record *buf)
+{
+  if(rec->size >= sizeof(*buf))
+    return (struct mp3_task_record *)rec;
+  memset(buf, 0, sizeof(*buf));
+  memcpy(buf, rec, rec->size);
+  return buf;
+}
+
+// This function adds one per-task sample to the summary of its pid.
+void summarize(struct mp3_task_record *rec)
+{
+  int i;
+
+  for(i=0; i<nsummary; i++)
+    if(summary[i].pid == rec->hdr.pid) break;
+  if(i == nsummary){
+    if(nsummary == MAX_PIDS) return;
+    summary[nsummary++].pid = rec->hdr.pid;
+  }
+  summary[i].samples++;
+  summary[i].min_flt += rec->min_flt;
+  summary[i].maj_flt += rec->maj_flt;
+  summary[i].cpu_time += rec->cpu_time;
+  summary[i].wss_pages += rec->wss_pages;
+  if(rec->wss_pages > summary[i].wss_max)
+    summary[i].wss_max = rec->wss_pages;
+  summary[i].fields |= rec->fields;
+  summary[i].rss_pages += rec->rss_pages;
+  if(rec->rss_pages > summary[i].rss_max)
+    summary[i].rss_max = rec->rss_pages;
+  if(rec->swap_pages > summary[i].swap_max)
+    summary[i].swap_max = rec->swap_pages;
+  summary[i].thp_pages += rec->thp_pages;
+  summary[i].numa_local += rec->numa_local;
+  summary[i].numa_remote += rec->numa_remote;
+}
+
+// This function adds one heat record to the summary of its VMA. A VMA that was resized counts as a new region.
+void summarize_heat(struct mp3_heat_record *rec)
+{
+  int i, j;
+
+  for(i=0; i<nregions; i++)
+    if(regions[i].pid == rec->hdr.pid && regions[i].vm_start == rec->vm_start && regions[i].vm_end == rec->vm_end) break;
+  if(i == nregions){
+    if(nregions == MAX_REGIONS) return;
+    memset(&regions[i], 0, sizeof(regions[i]));
+    regions[i].pid = rec->hdr.pid;
+    regions[i].kind = rec->kind;
+    regions[i].vm_start = rec->vm_start;
+    regions[i].vm_end = rec->vm_end;
+    regions[i].bucket_size = rec->bucket_size;
+    nregions++;
+  }
+  regions[i].faults += rec->faults;
+  for(j=0; j<MP3_HEAT_BUCKETS; j++)
+    regions[i].buckets[j] += rec->buckets[j];
+}
+
+// This function orders regions by decreasing sampled faults.
+int cmp_region(const void *a, const void *b)
+{
+  const struct region_summary *x = a, *y = b;
+  return x->faults < y->faults ? 1 : x->faults > y->faults ? -1 : 0;
+}
+
+// This function prints the VMAs with the most sampled faults and the hottest bucket of each.
+void print_regions()
+{
+  unsigned long long total = 0, lo;
+  int i, j, hot;
+
+  if(!nregions)
+    return;
+  for(i=0; i<nregions; i++)
+    total += regions[i].faults;
+  qsort(regions, nregions, sizeof(regions[0]), cmp_region);
+
+  printf("%-8s %-6s %-33s %-10s %-7s %s\n", "pid", "kind", "vma", "faults", "faults%", "hottest bucket");
+  for(i=0; i<nregions && i<TOP_REGIONS; i++){
+    hot = 0;
+    for(j=1; j<MP3_HEAT_BUCKETS; j++)
+      if(regions[i].buckets[j] > regions[i].buckets[hot]) hot = j;
+    lo = regions[i].vm_start + hot * regions[i].bucket_size;
+    printf("%-8u %-6s %016llx-%016llx %-10llu %-7.1f %016llx-%016llx (%llu faults)\n", regions[i].pid,
+           regions[i].kind < 4 ? heat_kinds[regions[i].kind] : "?", regions[i].vm_start, regions[i].vm_end,
+           regions[i].faults, total ? 100.0 * regions[i].faults / total : 0.0,
+           lo, lo + regions[i].bucket_size, regions[i].buckets[hot]);
+  }
+}
+
+// This function prints the memory counters of the tasks that sampled any, averaged over their samples.
+void print_memory()
+{
+  unsigned long long placed, fields = 0;
+  int i;
+
+  for(i=0; i<nsummary; i++)
+    fields |= summary[i].fields;
+  if(!(fields & (MP3_FIELD_RSS | MP3_FIELD_SWAP | MP3_FIELD_THP | MP3_FIELD_NUMA)))
+    return;
+
+  printf("%-8s %-10s %-10s %-10s %-10s %s\n", "pid", "rss avg", "rss max", "swap max", "thp avg", "numa remote%");
+  for(i=0; i<nsummary; i++){
+    if(!summary[i].samples || !summary[i].fields)
+      continue;
+    placed = summary[i].numa_local + summary[i].numa_remote;
+    printf("%-8u %-10llu %-10llu %-10llu %-10llu %.1f\n", summary[i].pid, summary[i].rss_pages / summary[i].samples,
+           summary[i].rss_max, summary[i].swap_max, summary[i].thp_pages / summary[i].samples,
+           placed ? 100.0 * summary[i].numa_remote / placed : 0.0);
+  }
+}
+
+// This function prints the per-task totals and each task's share of the major faults.
+void print_summary()
+{
+  unsigned long long total_maj = 0;
+  int i;
+
+  for(i=0; i<nsummary; i++)
+    total_maj += summary[i].maj_flt;
+
+  printf("%-8s %-8s %-12s %-12s %-12s %-7s %-10s %s\n", "pid", "samples", "minor", "major", "cpu", "major%",
+         "wss avg", "wss max (pages)");
+  for(i=0; i<nsummary; i++)
+    printf("%-8u %-8lu %-12llu %-12llu %-12llu %-7.1f %-10llu %llu\n", summary[i].pid, summary[i].samples,
+           summary[i].min_flt, summary[i].maj_flt, summary[i].cpu_time,
+           total_maj ? 100.0 * summary[i].maj_flt / total_maj : 0.0,
+           summary[i].samples ? summary[i].wss_pages / summary[i].samples : 0, summary[i].wss_max);
+  print_memory();
+  if(controls[MP3_CONTROL_SUSPEND] || controls[MP3_CONTROL_RESUME])
+    printf("thrashing control: %lu suspended, %lu resumed\n", controls[MP3_CONTROL_SUSPEND], controls[MP3_CONTROL_RESUME]);
+  print_regions();
+}
+
+// This function prints the memory counters of a task record on a line of their own, so the task lines keep their
+// columns for the scripts that read them.
+void print_counters(struct mp3_task_record *task)
+{
+  if(!(task->fields & ~(unsigned long long)MP3_FIELD_WSS))
+    return;
+  printf("%llu %u mem", (unsigned long long)task->hdr.jiffies, task->hdr.pid);
+  if(task->fields & MP3_FIELD_RSS)
+    printf(" rss %llu", (unsigned long long)task->rss_pages);
+  if(task->fields & MP3_FIELD_SWAP)
+    printf(" swap %llu", (unsigned long long)task->swap_pages);
+  if(task->fields & MP3_FIELD_THP)
+    printf(" thp %llu", (unsigned long long)task->thp_pages);
+  if(task->fields & MP3_FIELD_NUMA)
+    printf(" local %llu remote %llu", (unsigned long long)task->numa_local, (unsigned long long)task->numa_remote);
+  if(task->fields & MP3_FIELD_THP_FAULTS)
+    printf(" thp_faults %llu thp_fallbacks %llu", (unsigned long long)task->thp_faults,
+           (unsigned long long)task->thp_fallbacks);
+  printf("\n");
+}
+
+// This function prints one record and adds per-task records to the summary.
+void print_record(struct mp3_record_header *rec)
+{
+  struct mp3_task_record buf, *task = task_record(rec, &buf);
+  struct mp3_heat_record *heat = (struct mp3_heat_record *)rec;
+  struct mp3_control_record *control = (struct mp3_control_record *)rec;
+  int i;
+
+  switch(rec->type){
+    case MP3_RECORD_TASK:
+      summarize(task);
+      /* fall through */
+    case MP3_RECORD_AGGREGATE:
+      printf("%llu %u %llu %llu %llu %llu %llu %lld\n", (unsigned long long)rec->jiffies, rec->pid,
+             (unsigned long long)task->min_flt, (unsigned long long)task->maj_flt,
+             (unsigned long long)task->cpu_time, (unsigned long long)task->wss_pages,
+             (unsigned long long)rec->time_ns, (long long)rec->jitter_ns);
+      print_counters(task);
+      break;
+    case MP3_RECORD_HEAT:
+      summarize_heat(heat);
+      printf("%llu %u heat %llx-%llx %s %u:", (unsigned long long)rec->jiffies, rec->pid,
+             (unsigned long long)heat->vm_start, (unsigned long long)heat->vm_end,
+             heat->kind < 4 ? heat_kinds[heat->kind] : "?", heat->faults);
+      for(i=0; i<MP3_HEAT_BUCKETS; i++)
+        printf(" %u", heat->buckets[i]);
+      printf("\n");
+      break;
+    case MP3_RECORD_CONTROL:
+      if(control->action < 2)
+        controls[control->action]++;
+      printf("%llu %u control %s at %llu major/s (threshold %llu) and %u%% cpu, %u running %u suspended\n",
+             (unsigned long long)rec->jiffies, rec->pid, control->action < 2 ? control_actions[control->action] : "?",
+             (unsigned long long)control->maj_rate, (unsigned long long)control->threshold, control->util_pct,
+             control->running, control->suspended);
+      break;
+    default:
+      break;
+  }
+}
+
+// This function writes the buffered stream to disk.
+void out_flush()
+{
+  size_t off = 0;
+  ssize_t n;
+
+  while(off < out_len){
+    n = write(out_fd, out_buf + off, out_len - off);
+    if(n < 0){
+      if(errno == EINTR) continue;
+      perror("write");
+      break;
+    }
+    off += n;
+  }
+  out_total += off;
+  out_len = 0;
+}
+
+// This function appends an unsigned value as a varint, 7 bits per byte with the high bit set on all but the last byte.
+void put_varint(uint64_t v)
+{
+  // a varint is at most 10 bytes
+  if(out_len + 10 > OUT_BUF_SIZE)
+    out_flush();
+  while(v >= 0x80){
+    out_buf[out_len++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  out_buf[out_len++] = (unsigned char)v;
+}
+
+// This function appends a delta as a zigzag varint, so small negative deltas stay small too.
+void put_delta(uint64_t cur, uint64_t prev)
+{
+  int64_t d = (int64_t)(cur - prev);
+  put_varint(((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
+
+// This function appends one record to the stream.
+void encode_record(struct mp3_record_header *rec)
+{
+  struct mp3_task_record buf, *task = task_record(rec, &buf);
+  struct mp3_heat_record *heat = (struct mp3_heat_record *)rec;
+  struct mp3_control_record *control = (struct mp3_control_record *)rec;
+  struct stream_state *prev;
+  int i;
+
+  if(rec->type == MP3_RECORD_HEAT){
+    put_varint(rec->type);
+    put_varint(rec->pid);
+    put_delta(rec->jiffies, out_table.jiffies);
+    put_delta(rec->time_ns, out_table.time_ns);
+    put_delta(rec->jitter_ns, 0);
+    put_varint(heat->vm_start);
+    put_varint(heat->vm_end - heat->vm_start);
+    put_varint(heat->bucket_size);
+    put_varint(heat->kind);
+    for(i=0; i<MP3_HEAT_BUCKETS; i++)
+      put_varint(heat->buckets[i]);
+    out_table.jiffies = rec->jiffies;
+    out_table.time_ns = rec->time_ns;
+    return;
+  }
+  if(rec->type == MP3_RECORD_CONTROL){
+    put_varint(rec->type);
+    put_varint(rec->pid);
+    put_delta(rec->jiffies, out_table.jiffies);
+    put_delta(rec->time_ns, out_table.time_ns);
+    put_delta(rec->jitter_ns, 0);
+    put_varint(control->action);
+    put_varint(control->running);
+    put_varint(control->suspended);
+    put_varint(control->util_pct);
+    put_varint(control->maj_rate);
+    put_varint(control->threshold);
+    out_table.jiffies = rec->jiffies;
+    out_table.time_ns = rec->time_ns;
+    return;
+  }
+  if(rec->type != MP3_RECORD_TASK && rec->type != MP3_RECORD_AGGREGATE)
+    return;
+  prev = stream_prev(&out_table, rec->pid);
+  put_varint(rec->type);
+  put_varint(rec->pid);
+  put_delta(rec->jiffies, out_table.jiffies);
+  put_delta(rec->time_ns, out_table.time_ns);
+  put_delta(rec->jitter_ns, 0);
+  put_delta(task->min_flt, prev->min_flt);
+  put_delta(task->maj_flt, prev->maj_flt);
+  put_delta(task->cpu_time, prev->cpu_time);
+  put_delta(task->wss_pages, prev->wss_pages);
+  put_varint(task->fields);
+  put_delta(task->rss_pages, prev->rss_pages);
+  put_delta(task->swap_pages, prev->swap_pages);
+  put_delta(task->thp_pages, prev->thp_pages);
+  put_delta(task->numa_local, prev->numa_local);
+  put_delta(task->numa_remote, prev->numa_remote);
+  put_delta(task->thp_faults, prev->thp_faults);
+  put_delta(task->thp_fallbacks, prev->thp_fallbacks);
+  out_table.jiffies = rec->jiffies;
+  out_table.time_ns = rec->time_ns;
+  prev->min_flt = task->min_flt;
+  prev->maj_flt = task->maj_flt;
+  prev->cpu_time = task->cpu_time;
+  prev->wss_pages = task->wss_pages;
+  prev->rss_pages = task->rss_pages;
+  prev->swap_pages = task->swap_pages;
+  prev->thp_pages = task->thp_pages;
+  prev->numa_local = task->numa_local;
+  prev->numa_remote = task->numa_remote;
+  prev->thp_faults = task->thp_faults;
+  prev->thp_fallbacks = task->thp_fallbacks;
+}
+
+// This function returns the ring with a given index.
+struct mp3_ring_header *ring_of(struct mp3_buffer_header *hdr, unsigned i)
+{
+  return (struct mp3_ring_header *)((unsigned char *)hdr + hdr->data_offset + (unsigned long)i * hdr->ring_stride);
+}
+
+// This function returns the next unread record of a ring, skipping pad records, or NULL if the ring is drained.
+struct mp3_record_header *ring_peek(struct mp3_buffer_header *hdr, struct ring_cursor *c)
+{
+  struct mp3_record_header *rec;
+
+  while(c->consumer < c->producer){
+    rec = (struct mp3_record_header *)(c->data + (c->consumer & (hdr->data_size - 1)));
+    // pad records can be shorter than a record header
+    if(rec->size < MP3_RECORD_ALIGN || rec->size > hdr->data_size){
+      printf("corrupt record at %llu, skipping to the producer\n", c->consumer);
+      c->consumer = c->producer;
+      break;
+    }
+    if(rec->type != MP3_RECORD_PAD)
+      return rec;
+    c->consumer += rec->size;
+  }
+  return NULL;
+}
+
+// This function returns the time a record was sampled at, which orders the records of all rings. Modules before
+// version 7 only stamp records with jiffies.
+unsigned long long record_time(struct mp3_buffer_header *hdr, struct mp3_record_header *rec)
+{
+  return hdr->version >= 7 ? rec->time_ns : rec->jiffies;
+}
+
+// This function returns a record with the current record header, see stream_record_of.
+struct mp3_record_header *record_of(struct mp3_buffer_header *hdr, struct mp3_record_header *rec, union stream_record *buf)
+{
+  return stream_record_of(hdr->version, rec, buf);
+}
+
+// This function consumes every record the kernel produced since the last call, and returns how many were read.
+// Every cpu has its own ring, whose records are in time order, so the rings are merged by always taking the
+// oldest record at the head of any ring. The producer indices are loaded with acquire semantics so the records
+// they cover are visible, and the consumer indices are stored with release semantics so the kernel does not reuse
+// the space before we are done with it. Every record is passed to handle.
+int drain(struct mp3_buffer_header *hdr, void (*handle)(struct mp3_record_header *))
+{
+  struct mp3_record_header *rec, *next;
+  union stream_record buf;
+  struct ring_cursor *next_ring;
+  unsigned i;
+  int n = 0;
+
+  for(i=0; i<hdr->nr_rings; i++){
+    cursors[i].ring = ring_of(hdr, i);
+    cursors[i].data = (unsigned char *)cursors[i].ring + hdr->page_size;
+    cursors[i].producer = __atomic_load_n(&cursors[i].ring->producer, __ATOMIC_ACQUIRE);
+    cursors[i].consumer = cursors[i].ring->consumer;
+  }
+
+  while(1){
+    next = NULL;
+    next_ring = NULL;
+    for(i=0; i<hdr->nr_rings; i++){
+      rec = ring_peek(hdr, &cursors[i]);
+      if(rec && (!next || record_time(hdr, rec) < record_time(hdr, next))){
+        next = rec;
+        next_ring = &cursors[i];
+      }
+    }
+    if(!next)
+      break;
+    handle(record_of(hdr, next, &buf));
+    next_ring->consumer += next->size;
+    n++;
+  }
+
+  for(i=0; i<hdr->nr_rings; i++)
+    __atomic_store_n(&cursors[i].ring->consumer, cursors[i].consumer, __ATOMIC_RELEASE);
+  return n;
+}
+
+// This function sums a counter of the ring headers.
+unsigned long long ring_sum(struct mp3_buffer_header *hdr, size_t field)
+{
+  unsigned long long sum = 0;
+  unsigned i;
+
+  for(i=0; i<hdr->nr_rings; i++)
+    sum += __atomic_load_n((__u64 *)((unsigned char *)ring_of(hdr, i) + field), __ATOMIC_RELAXED);
+  return sum;
+}
+
+// This function stops the collector at the next wakeup.
+void on_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+// This function drains the buffer until SIGINT or SIGTERM and writes the records to fname in the stream format.
+// It sleeps in poll() until the module reports the wakeup watermark was reached, and only writes to disk when
+// OUT_BUF_SIZE bytes of encoded records have built up, so a long run costs a few syscalls per megabyte.
+int collect(struct mp3_buffer_header *hdr, char *fname)
+{
+  struct pollfd pfd;
+  struct sigaction sa;
+  unsigned long long records = 0, lost, start_lost, overrun;
+
+  out_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(out_fd < 0){
+    perror(fname);
+    return -1;
+  }
+
+  // no SA_RESTART, so the signal also interrupts poll()
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  memcpy(out_buf, STREAM_MAGIC, 4);
+  out_buf[4] = STREAM_VERSION;
+  out_len = STREAM_HEADER_SIZE;
+
+  // the overrun counters count from when the module was loaded, so only losses after this point are ours
+  lost = ring_sum(hdr, offsetof(struct mp3_ring_header, overrun));
+  start_lost = lost;
+
+  pfd.fd = buf_fd;
+  pfd.events = POLLIN;
+  while(1){
+    records += drain(hdr, encode_record);
+    overrun = ring_sum(hdr, offsetof(struct mp3_ring_header, overrun));
+    if(overrun != lost){
+      put_varint(STREAM_LOST);
+      put_varint(overrun - lost);
+      lost = overrun;
+    }
+    if(stop)
+      break;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR){
+      perror("poll");
+      break;
+    }
+  }
+  out_flush();
+  close(out_fd);
+
+  printf("collected %llu records into %s (%llu bytes)\n", records, fname, out_total);
+  if(lost != start_lost)
+    printf("lost %llu records because the buffer was full\n", lost - start_lost);
+  return 0;
+}
+
+// This function moves the records of the buffer into fname until SIGINT or SIGTERM without copying them: splice()
+// hands the pages of the rings to a pipe and then to the file, which only keeps them until they are written out.
+// The file holds the raw records behind RAW_MAGIC and the buffer version, a run of whole records of one cpu at a
+// time, so they are not in time order across cpus. The module is the consumer, so nothing else may drain it.
+int archive(struct mp3_buffer_header *hdr, char *fname)
+{
+  unsigned char raw[RAW_HEADER_SIZE];
+  uint32_t version = hdr->version;
+  unsigned long long total = 0, lost, start_lost;
+  struct sigaction sa;
+  int pfd[2], fd;
+  ssize_t n, m;
+
+  fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0){
+    perror(fname);
+    return -1;
+  }
+  if(pipe(pfd)){
+    perror("pipe");
+    close(fd);
+    return -1;
+  }
+  memcpy(raw, RAW_MAGIC, 4);
+  memcpy(raw + 4, &version, 4);
+  if(write(fd, raw, RAW_HEADER_SIZE) != RAW_HEADER_SIZE){
+    perror(fname);
+    close(fd);
+    return -1;
+  }
+
+  // the overrun counters count from when the module was loaded
+  start_lost = ring_sum(hdr, offsetof(struct mp3_ring_header, overrun));
+
+  // no SA_RESTART, so the signal also interrupts a splice waiting for records
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  while(!stop){
+    n = splice(buf_fd, NULL, pfd[1], NULL, RAW_SPLICE_SIZE, SPLICE_F_MOVE);
+    if(n < 0){
+      if(errno != EINTR)
+        perror("splice");
+      break;
+    }
+    // the whole pipe is written out even after a signal, so the file never ends in the middle of a record
+    while(n > 0){
+      m = splice(pfd[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+      if(m < 0 && errno == EINTR)
+        continue;
+      if(m <= 0){
+        perror(fname);
+        stop = 1;
+        break;
+      }
+      n -= m;
+      total += m;
+    }
+  }
+  close(pfd[0]);
+  close(pfd[1]);
+  close(fd);
+
+  printf("archived %llu bytes of records into %s\n", total, fname);
+  lost = ring_sum(hdr, offsetof(struct mp3_ring_header, overrun)) - start_lost;
+  if(lost)
+    printf("lost %llu records because the buffer was full\n", lost);
+  return 0;
+}
+
+// This function prints the records of an archive written by archive(), in file order, followed by the per-pid summary.
+int decode_raw(unsigned char *map, size_t len)
+{
+  struct raw_reader r;
+  struct mp3_record_header *rec;
+  union stream_record buf;
+  unsigned long long records = 0;
+  int truncated;
+
+  raw_open(&r, map, len);
+  while((rec = raw_next(&r, &buf, &truncated))){
+    print_record(rec);
+    records++;
+  }
+  if(truncated)
+    printf("truncated record at %zu\n", (size_t)(r.p - map));
+
+  printf("read %llu profiled data\n", records);
+  print_summary();
+  return 0;
+}
+
+// This function reads a stream written by collect() and prints it like a live drain, followed by the per-pid summary.
+// Archives written by archive() are printed by decode_raw().
+int decode(char *fname)
+{
+  static struct stream_reader r;
+  union stream_record rec;
+  unsigned long long records = 0;
+  struct stat st;
+  void *map;
+  int fd, ret;
+
+  fd = open(fname, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st)){
+    perror(fname);
+    return -1;
+  }
+  map = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if(map != MAP_FAILED && st.st_size >= RAW_HEADER_SIZE && !memcmp(map, RAW_MAGIC, 4)){
+    ret = decode_raw(map, st.st_size);
+    munmap(map, st.st_size);
+    return ret;
+  }
+  if(map == MAP_FAILED || stream_open(&r, map, st.st_size)){
+    printf("%s is not a version %d MP3 stream\n", fname, STREAM_VERSION);
+    if(map != MAP_FAILED)
+      munmap(map, st.st_size);
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  while((ret = stream_next(&r, &rec)) > 0){
+    print_record(&rec.hdr);
+    records++;
+  }
+  if(ret < 0)
+    printf("truncated entry at the end of %s\n", fname);
+  munmap(map, st.st_size);
+
+  printf("read %llu profiled data\n", records);
+  if(r.lost)
+    printf("lost %llu records because the buffer was full\n", (unsigned long long)r.lost);
+  print_summary();
+  return 0;
+}
+
+// This function registers (-r) or unregisters (-u) the pids in one ioctl. The letters after the option are the
+// registration flags: t for every thread of each thread group, c for every process they fork later.
+int register_pids(char *option, int npids, char **pids)
+{
+  struct mp3_register reg;
+  int32_t list[MP3_REGISTER_MAX];
+  const char *f;
+  int fd, i, ret;
+
+  if(npids > MP3_REGISTER_MAX){
+    printf("at most %d pids at once\n", MP3_REGISTER_MAX);
+    return -1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  for(f = option + 2; *f; f++){
+    if(*f == 't')
+      reg.flags |= MP3_REGISTER_THREADS;
+    else if(*f == 'c')
+      reg.flags |= MP3_REGISTER_CHILDREN;
+  }
+  for(i=0; i<npids; i++)
+    list[i] = atoi(pids[i]);
+  reg.count = npids;
+  reg.pids = (uintptr_t)list;
+
+  fd = open("node", O_RDWR);
+  if(fd < 0){
+    printf("file open error. node\n");
+    return -1;
+  }
+  ret = ioctl(fd, option[1] == 'r' ? MP3_IOC_REGISTER : MP3_IOC_UNREGISTER, &reg);
+  close(fd);
+  if(ret < 0){
+    perror("ioctl");
+    return -1;
+  }
+  printf("%s %d tasks\n", option[1] == 'r' ? "registered" : "unregistered", ret);
+  return 0;
+}
+
+// This function opens a private session on the "session" node (minor 1 of the device), samples the pids in it every
+// interval microseconds and collects its records into fname until interrupted. The session, and the registration
+// of its tasks, ends when the collector exits, and does not disturb other sessions or the shared one.
+int collect_session(char *fname, char *interval, int npids, char **pids)
+{
+  struct mp3_buffer_header *hdr;
+  struct mp3_register reg;
+  int32_t list[MP3_REGISTER_MAX];
+  uint32_t us = atoi(interval);
+  int i, ret;
+
+  if(npids > MP3_REGISTER_MAX){
+    printf("at most %d pids at once\n", MP3_REGISTER_MAX);
+    return -1;
+  }
+  buf_fd = open("session", O_RDWR);
+  if(buf_fd < 0){
+    printf("file open error. session\n");
+    return -1;
+  }
+  for(i=0; i<npids; i++)
+    list[i] = atoi(pids[i]);
+  memset(&reg, 0, sizeof(reg));
+  reg.count = npids;
+  reg.pids = (uintptr_t)list;
+  if(ioctl(buf_fd, MP3_IOC_INTERVAL, &us) < 0 || (ret = ioctl(buf_fd, MP3_IOC_REGISTER, &reg)) < 0){
+    perror("ioctl");
+    buf_exit();
+    return -1;
+  }
+  printf("registered %d tasks in a private session\n", ret);
+
+  hdr = buf_init("session");
+  if(!hdr){
+    buf_exit();
+    return -1;
+  }
+  ret = collect(hdr, fname);
+  buf_exit();
+  return ret;
+}
+
+// Usage: ./monitor           prints the records in the buffer and exits
+//        ./monitor -c FILE   collects records into FILE until interrupted
+//        ./monitor -x FILE   archives the raw records into FILE with splice() until interrupted
+//        ./monitor -d FILE   prints the records collected or archived in FILE
+//        ./monitor -r[tc] PID...   registers the pids, with their threads (t) and future children (c)
+//        ./monitor -u[t] PID...    unregisters the pids, with their threads (t)
+//        ./monitor -s FILE US PID...   collects the pids into FILE in a private session sampled every US microseconds
 int main(int argc, char* argv[])
 {
-  long *buf;
-  int index = 0;
+  struct mp3_buffer_header *hdr;
+  unsigned long long overrun, faults, fault_overrun;
   int i;
 
+  if(argc == 3 && !strcmp(argv[1], "-d"))
+    return decode(argv[2]) ? 1 : 0;
+  if(argc >= 3 && (!strncmp(argv[1], "-r", 2) || !strncmp(argv[1], "-u", 2)))
+    return register_pids(argv[1], argc - 2, argv + 2) ? 1 : 0;
+  if(argc >= 5 && !strcmp(argv[1], "-s"))
+    return collect_session(argv[2], argv[3], argc - 4, argv + 4) ? 1 : 0;
+  if(argc != 1 && !(argc == 3 && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "-x")))){
+    printf("Usage: %s [-c stream file | -x archive file | -d stream or archive file | -r[tc] pid... | -u[t] pid... | -s stream file us pid...]\n", argv[0]);
+    return 2;
+  }
+
   // Open the char device and mmap()
-  buf = buf_init("node");
-  if(!buf)
+  hdr = buf_init("node");
+  if(!hdr)
     return -1;
-  
-  // Read and print profiled data
-  for(index=0; index<BUFD_MAX; index++)
-    if(buf[index] != -1) break;
-
-  i = 0;
-  while(buf[index] != -1){
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%ld\n", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-    i++;
+  printf("%u buffers of %u bytes, sampling every %uus\n", hdr->nr_rings, hdr->data_size, hdr->sample_interval_us);
+
+  if(argc == 3){
+    i = argv[1][1] == 'x' ? archive(hdr, argv[2]) : collect(hdr, argv[2]);
+    buf_exit();
+    return i ? 1 : 0;
   }
+
+  // Read and print profiled data, one line per task and sample
+  i = drain(hdr, print_record);
   printf("read %d profiled data\n", i);
+  overrun = ring_sum(hdr, offsetof(struct mp3_ring_header, overrun));
+  if(overrun)
+    printf("lost %llu of %llu records because the buffer was full\n",
+           overrun, ring_sum(hdr, offsetof(struct mp3_ring_header, seq)));
+  faults = ring_sum(hdr, offsetof(struct mp3_ring_header, fault_samples));
+  fault_overrun = ring_sum(hdr, offsetof(struct mp3_ring_header, fault_overrun));
+  if(faults || fault_overrun)
+    printf("sampled %llu fault addresses, dropped %llu\n", faults, fault_overrun);
+  print_summary();
 
   // Close the char device
   buf_exit();
 }
-
@@ -5,6 +5,7 @@
 #include <linux/proc_fs.h>
 #include <linux/list.h>
 #include "mp3_given.h"
+#include "mp3_shared.h"
 #include <linux/uaccess.h>	/* for copy_*_user */
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
@@ -13,6 +14,23 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/mm.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/tracepoint.h>
+#include <linux/kallsyms.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/vmstat.h>
+#include <linux/timekeeping.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/kref.h>
+#include <linux/sort.h>
+#include <linux/mmu_notifier.h>
+#include <linux/page_idle.h>
 
 #include <asm/page_types.h>
 
@@ -25,10 +43,93 @@ MODULE_DESCRIPTION("CS-423 MP3");
 
 #define KB (1<<10)
 
-#define VBUFFER_SIZE_B (4*128*KB)
+#define MIN_SAMPLE_INTERVAL_US 1000
+#define MAX_SAMPLE_INTERVAL_US 10000000
+
+#define FAULT_STAGE_SIZE 256     //sampled fault addresses staged per cpu between two samples
+#define PID_TABLE_BITS 10        //pids a lock free pid table holds, log2
+#define FOLLOW_QUEUE_SIZE 256    //forks and exits of followed tasks staged between two registration works
+#define FAULT_HEAT_MAX 64        //VMAs with a heat record per sample
+#define MAX_SESSIONS 16           //private sessions open at once
+#define MP3_MINORS 2              //MP3_MINOR_SHARED and MP3_MINOR_SESSION
+
+//sampling interval, can be changed at runtime
+static unsigned int sample_interval_us = 50000;
+module_param(sample_interval_us, uint, 0644);
+MODULE_PARM_DESC(sample_interval_us, "Sampling interval in microseconds (1000 to 10000000)");
+
+//unread task records at which readers and pollers are woken
+static unsigned int wakeup_watermark = 1;
+module_param(wakeup_watermark, uint, 0644);
+MODULE_PARM_DESC(wakeup_watermark, "Unread samples (in task records) that make the device readable");
+
+//size of the record ring of each cpu in pages, rounded up to a power of two
+static unsigned int buffer_pages = 64;
+module_param(buffer_pages, uint, 0444);
+MODULE_PARM_DESC(buffer_pages, "Size of the record ring of each cpu in pages, not counting the header pages");
+
+//sample one in this many page faults of registered tasks, 0 to disable
+static unsigned int fault_sample_period = 0;
+module_param(fault_sample_period, uint, 0444);
+MODULE_PARM_DESC(fault_sample_period, "Sample the address of one in this many page faults of registered tasks, 0 to disable");
+
+//estimate the working set of every task by scanning its accessed bits each sample
+static bool wss_sample = false;
+module_param(wss_sample, bool, 0644);
+MODULE_PARM_DESC(wss_sample, "Estimate the working set of every task each sample");
+
+//count the huge pages of every task and the nodes its pages are on each sample
+static bool placement_sample = false;
+module_param(placement_sample, bool, 0644);
+MODULE_PARM_DESC(placement_sample, "Count the transparent huge pages and the NUMA local and remote pages of every task each sample");
+
+//emit a record summing all tasks after the per-task records
+static bool aggregate_sample = true;
+module_param(aggregate_sample, bool, 0644);
+MODULE_PARM_DESC(aggregate_sample, "Emit an aggregate record after the per-task records of every sample");
+
+//suspend registered tasks while they thrash, and resume them once the fault rate recovers
+static bool thrash_control = false;
+module_param(thrash_control, bool, 0644);
+MODULE_PARM_DESC(thrash_control, "Suspend the lowest priority tasks while the registered tasks thrash");
+
+//major faults per second of all tasks above which they may be thrashing
+static unsigned int thrash_fault_rate = 100;
+module_param(thrash_fault_rate, uint, 0644);
+MODULE_PARM_DESC(thrash_fault_rate, "Major faults per second of all tasks that count as thrashing");
+
+//cpu utilization below which a high fault rate counts as thrashing
+static unsigned int thrash_util_pct = 50;
+module_param(thrash_util_pct, uint, 0644);
+MODULE_PARM_DESC(thrash_util_pct, "Cpu utilization in percent of the online cpus below which a high fault rate counts as thrashing");
+
+//consecutive samples a condition must hold before the controller acts
+static unsigned int thrash_window = 3;
+module_param(thrash_window, uint, 0644);
+MODULE_PARM_DESC(thrash_window, "Consecutive samples of thrashing (or of recovery) before a task is suspended (or resumed)");
 
 /**
- * @brief the mp3_task_struct contains all relevant information about tasks
+ * @brief the counters of one task record, see struct mp3_task_record
+ */
+struct mp3_counters {
+	u64 fields;
+	unsigned long min_flt;
+	unsigned long maj_flt;
+	unsigned long cpu_time;
+	unsigned long wss_pages;
+	unsigned long rss_pages;
+	unsigned long swap_pages;
+	unsigned long thp_pages;
+	unsigned long numa_local;
+	unsigned long numa_remote;
+	unsigned long thp_faults;
+	unsigned long thp_fallbacks;
+};
+
+/**
+ * @brief the mp3_task_struct contains all relevant information about tasks.
+ * The counters hold the change during the last interval, the prev_ counters
+ * the absolute values of the task at the last sample.
  */
 typedef struct mp3_task_struct_t {
 		struct task_struct* linux_task;
@@ -36,6 +137,16 @@ typedef struct mp3_task_struct_t {
 		unsigned long stime;
 		unsigned long major_fault;
 		unsigned long minor_fault;
+		unsigned long prev_utime;
+		unsigned long prev_stime;
+		unsigned long prev_major_fault;
+		unsigned long prev_minor_fault;
+		struct mp3_counters sample;
+		struct mp3_session *session;
+		unsigned long seq;
+		pid_t tgid;
+		bool suspended;
+		unsigned long suspended_at;
 		pid_t pid;
 		struct list_head task_node;
 } mp3_task_struct;
@@ -45,96 +156,1692 @@ typedef struct mp3_task_struct_t {
 static unsigned long procfs_buffer_size = 0;
 static char procfs_buffer[PROCFS_MAX_SIZE];
 
-static struct proc_dir_entry *proc_dir;
-static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *proc_dir;
+static struct proc_dir_entry *proc_entry;
+
+/**
+ * @brief one ring of a session buffer, written by the work of one cpu only
+ */
+struct mp3_ring {
+	struct mp3_ring_header *header;
+	uint8_t *data;
+	u64 reserved;
+	struct mp3_session *session;
+
+	//read position of chardev_read, protected by the read_mutex of the session
+	u64 read_pos;
+	u64 read_end;
+
+	//end of the records handed to a pipe by chardev_splice_read, which are
+	//consumed once the pipe releases them, protected by the read_mutex
+	u64 splice_pos;
+};
+
+/**
+ * @brief a profiling session: a buffer of a header page followed by one ring
+ * per cpu, the tasks registered in it and its sampling interval. The shared
+ * session belongs to /proc/mp3/status and minor 0 of the device, and every
+ * open of minor 1 creates a private one. All sessions are sampled by the same
+ * timer and per cpu works, each at its own interval.
+ */
+struct mp3_session {
+	uint8_t *vbuffer;
+	struct mp3_buffer_header *header;
+	unsigned long total_b;
+	struct mp3_ring *rings;
+
+	//the interval of a private session, the shared one uses sample_interval_us
+	unsigned int interval_us;
+	atomic_t num_entries;
+
+	//when the session is sampled next and whether the round in progress
+	//samples it, written by the timer under session_lock
+	u64 next_ns;
+	bool due;
+
+	//readers blocked in read or poll, and the lock that serializes read
+	wait_queue_head_t wait;
+	struct mutex read_mutex;
+
+	//the ring chardev_splice_read starts at, protected by read_mutex
+	int splice_ring;
+
+	//held by the file and by every pipe buffer that maps the rings
+	struct kref ref;
+	struct list_head node;
+};
+
+//size of the records of each ring, a power of two, which follow a ring header page
+static unsigned long vbuffer_size_b;
+
+//the shared session and the list of all sessions, which the timer walks
+static struct mp3_session shared_session;
+static LIST_HEAD(sessions);
+static DEFINE_SPINLOCK(session_lock);
+static unsigned int num_sessions;
+
+//workqueue things
+static struct workqueue_struct *queue;
+static struct hrtimer sample_timer;
+
+//character device driver
+static dev_t mp3_dev;
+struct cdev mp3_cdev;
+
+/**
+ * @brief one sampled fault address
+ */
+struct mp3_fault_sample {
+	pid_t pid;
+	unsigned long address;
+};
+
+/**
+ * @brief the fault addresses sampled on one cpu since the last sample
+ */
+struct mp3_fault_stage {
+	spinlock_t lock;
+	unsigned int n;
+	unsigned long dropped;
+	struct mp3_fault_sample samples[FAULT_STAGE_SIZE];
+};
+
+/**
+ * @brief the fault histogram of one VMA of one task during one sample
+ */
+struct mp3_heat {
+	pid_t pid;
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long bucket_size;
+	u32 kind;
+	u32 faults;
+	u32 buckets[MP3_HEAT_BUCKETS];
+};
+
+/**
+ * @brief the sampler of one cpu. Every registered task is sampled by one cpu,
+ * which writes its records into the ring of that cpu in the session of the
+ * task only, so samplers never share a lock or a ring with each other.
+ */
+struct mp3_cpu {
+	//the index of this cpu, which is also the index of its ring in every session
+	int cpu;
+
+	//the tasks sampled by this cpu
+	struct mutex lock;
+	struct list_head tasks;
+	unsigned int num_entries;
+	struct work_struct work;
+
+	//fault addresses staged by the probe on this cpu and the histograms built from them
+	struct mp3_fault_stage stage;
+	unsigned int fault_tick;
+	struct mp3_fault_sample scratch[FAULT_STAGE_SIZE];
+	struct mp3_heat heat[FAULT_HEAT_MAX];
+	unsigned int nheat;
+} ____cacheline_aligned_in_smp;
+
+//per cpu samplers, indexed by cpu id
+static struct mp3_cpu *mp3_cpus;
+
+/**
+ * @brief an open addressing hash set of pids that tracepoint probes can read
+ * without a lock. 0 marks a free slot.
+ */
+struct mp3_pid_table {
+	spinlock_t lock;
+	pid_t pids[1 << PID_TABLE_BITS];
+};
+
+//the pids registered in the shared session, which the fault and exit probes filter on
+static struct mp3_pid_table registered_pids = { .lock = __SPIN_LOCK_UNLOCKED(registered_pids.lock) };
+
+//thread groups whose new threads, and processes whose new children, are registered
+static struct mp3_pid_table follow_threads = { .lock = __SPIN_LOCK_UNLOCKED(follow_threads.lock) };
+static struct mp3_pid_table follow_children = { .lock = __SPIN_LOCK_UNLOCKED(follow_children.lock) };
+
+/**
+ * @brief a fork or exit seen by the probes, registered or unregistered by
+ * the follow work
+ */
+struct mp3_follow_event {
+	pid_t pid;
+	u32 flags;   //registration flags of a new task
+	bool exit;
+};
+
+/**
+ * @brief the forks and exits staged by the probes since the last follow work
+ */
+struct mp3_follow_queue {
+	spinlock_t lock;
+	unsigned int n;
+	unsigned long dropped;
+	struct mp3_follow_event events[FOLLOW_QUEUE_SIZE];
+};
+
+//following of forks and exits, serialized by register_mutex
+static struct mp3_follow_queue follow_queue = { .lock = __SPIN_LOCK_UNLOCKED(follow_queue.lock) };
+static struct mp3_follow_event follow_scratch[FOLLOW_QUEUE_SIZE];
+static struct tracepoint *fork_tracepoint;
+static struct tracepoint *exit_tracepoint;
+static bool follow_probes_registered;
+static struct work_struct follow_work;
+
+//working set sampling: the accessed bit helpers are not exported, so they
+//are looked up by name at load time
+static int (*mp3_ptep_clear_flush_young)(struct vm_area_struct *vma, unsigned long address, pte_t *ptep);
+static int (*mp3_pmdp_clear_flush_young)(struct vm_area_struct *vma, unsigned long address, pmd_t *pmdp);
+static int (*mp3_mmu_notifier_clear_flush_young)(struct mm_struct *mm, unsigned long start, unsigned long end);
+static bool wss_available;
+
+//fault sampling
+static DEFINE_MUTEX(fault_mutex);
+static struct tracepoint *fault_tracepoint;
+static bool fault_probe_registered;
+
+//number of registered tasks, and the lock that serializes registration
+static atomic_t num_entries = ATOMIC_INIT(0);
+static DEFINE_MUTEX(register_mutex);
+
+//the sampling round in progress: the cpus taking part, how many have not
+//finished yet, and the totals of the ones that have, which the last one emits
+static struct cpumask round_mask;
+static atomic_t round_pending = ATOMIC_INIT(0);
+static unsigned long round_jiffies_now;
+static u64 round_expected_ns;
+static struct mp3_counters round_total;
+static DEFINE_SPINLOCK(round_lock);
+
+//thrashing controller, only used by the last cpu of a round: consecutive
+//thrashing and calm samples, and the registration counter that orders tasks
+static unsigned int thrash_hot_rounds;
+static unsigned int thrash_calm_rounds;
+static atomic_t thrash_suspended = ATOMIC_INIT(0);
+static unsigned long register_seq;
+
+/**
+ * @brief mp3_sample_interval - The sampling interval, clamped to the supported
+ * range since the module parameter can be written directly
+ * @return the interval in microseconds
+ */
+static unsigned int mp3_sample_interval(void){
+	return clamp_t(unsigned int, READ_ONCE(sample_interval_us), MIN_SAMPLE_INTERVAL_US, MAX_SAMPLE_INTERVAL_US);
+}
+
+/**
+ * @brief mp3_session_interval - The sampling interval of a session
+ * @param s - the session
+ * @return the interval in microseconds
+ */
+static unsigned int mp3_session_interval(struct mp3_session *s){
+	if(s == &shared_session) return mp3_sample_interval();
+	return READ_ONCE(s->interval_us);
+}
+
+/**
+ * @brief mp3_sessions_due_locked - Marks the sessions whose interval has
+ * passed as due for the round starting at expected, and returns the
+ * interval the timer has to tick at for all sessions with tasks: the
+ * shortest of them. Caller holds session_lock.
+ * @param expected - the expiry of the timer starting the round
+ * @param start - whether a round starts, or only the next tick is needed
+ * @return the timer interval in nanoseconds
+ */
+static u64 mp3_sessions_due_locked(u64 expected, bool start){
+	struct mp3_session *s;
+	u64 interval, tick = 0;
+
+	list_for_each_entry(s, &sessions, node){
+		if(start) s->due = false;
+		if(!atomic_read(&s->num_entries)) continue;
+		interval = (u64)mp3_session_interval(s) * NSEC_PER_USEC;
+		if(!tick || interval < tick) tick = interval;
+		if(!start) continue;
+		//expected is on the grid of the timer, half the shortest possible
+		//tick of slack keeps a session from slipping to the tick after its own
+		s->due = s->next_ns <= expected + MIN_SAMPLE_INTERVAL_US * NSEC_PER_USEC / 2;
+		if(!s->due) continue;
+		s->next_ns += interval;
+		if(s->next_ns <= expected) s->next_ns = expected + interval;
+	}
+	return tick ? tick : (u64)mp3_sample_interval() * NSEC_PER_USEC;
+}
+
+/**
+ * @brief sample_timer_callback - Starts a sampling round every interval by
+ * queueing the work of every cpu that has tasks or staged fault addresses on
+ * that cpu. The timer ticks at the shortest interval of the sessions, and a
+ * round only samples the sessions that are due. A tick is skipped while the
+ * previous round is still running. The hrtimer keeps the cadence exact at
+ * millisecond intervals, which jiffies based delayed work can not. The tasks
+ * of a cpu that went offline stay on it and are sampled by an online cpu,
+ * still into the ring of their cpu. Stops once no tasks are registered.
+ * @param timer - the sampling timer
+ * @return HRTIMER_RESTART while tasks are registered
+ */
+static enum hrtimer_restart sample_timer_callback(struct hrtimer *timer){
+	u64 expected = ktime_to_ns(hrtimer_get_expires(timer));
+	bool start;
+	u64 tick;
+	int cpu;
+
+	if(!atomic_read(&num_entries)) return HRTIMER_NORESTART;
+	start = !atomic_read(&round_pending);
+	spin_lock(&session_lock);
+	tick = mp3_sessions_due_locked(expected, start);
+	spin_unlock(&session_lock);
+	hrtimer_forward_now(timer, ns_to_ktime(tick));
+	if(!start) return HRTIMER_RESTART;
+
+	cpumask_clear(&round_mask);
+	for_each_possible_cpu(cpu){
+		if(READ_ONCE(mp3_cpus[cpu].num_entries) || READ_ONCE(mp3_cpus[cpu].stage.n))
+			cpumask_set_cpu(cpu, &round_mask);
+	}
+	if(cpumask_empty(&round_mask)) return HRTIMER_RESTART;
+
+	WRITE_ONCE(round_jiffies_now, jiffies);
+	WRITE_ONCE(round_expected_ns, expected);
+	atomic_set(&round_pending, cpumask_weight(&round_mask));
+	for_each_cpu(cpu, &round_mask){
+		//a work never runs twice at once, so the ring of the cpu keeps a single producer
+		if(cpu_online(cpu)) queue_work_on(cpu, queue, &mp3_cpus[cpu].work);
+		else queue_work(queue, &mp3_cpus[cpu].work);
+	}
+	return HRTIMER_RESTART;
+}
+
+/**
+ * @brief mp3_ring_reserve - Reserves space for a record in the ring of a cpu.
+ * Records do not wrap, so if the record does not fit before the end of the
+ * ring the rest of the ring is filled with a pad record first. If the reader
+ * has not freed enough space, the record is dropped and counted as an overrun.
+ * Only the work of the cpu produces records in its ring, so no locking is
+ * needed.
+ * @param r - the ring of the cpu in a session
+ * @param size - size of the record, a multiple of MP3_RECORD_ALIGN
+ * @return pointer to the record, NULL if it was dropped
+ */
+static void *mp3_ring_reserve(struct mp3_ring *r, u16 size){
+	u64 producer = r->header->producer;
+	u64 consumer = smp_load_acquire(&r->header->consumer);
+	u32 offset = producer & (vbuffer_size_b - 1);
+	u32 to_end = vbuffer_size_b - offset;
+	u32 needed = size + (to_end < size ? to_end : 0);
+	struct mp3_record_header *pad;
+
+	//the consumer is written by userspace, so do not trust it to be sane
+	if(producer - consumer > vbuffer_size_b || producer - consumer + needed > vbuffer_size_b){
+		r->header->seq++;
+		r->header->overrun++;
+		return NULL;
+	}
+
+	if(to_end < size){
+		pad = (struct mp3_record_header *)(r->data + offset);
+		pad->type = MP3_RECORD_PAD;
+		pad->size = to_end;
+		producer += to_end;
+		offset = 0;
+	}
+	r->reserved = producer + size;
+	return r->data + offset;
+}
+
+/**
+ * @brief mp3_ring_commit - Publishes the record returned by the last
+ * mp3_ring_reserve on a ring to the reader
+ * @param r - the ring
+ */
+static void mp3_ring_commit(struct mp3_ring *r){
+	r->header->seq++;
+	smp_store_release(&r->header->producer, r->reserved);
+}
+
+/**
+ * @brief mp3_ring_unread - Number of bytes the reader of a session has not
+ * consumed yet, summed over all its rings
+ * @param s - the session
+ * @return unread bytes
+ */
+static u64 mp3_ring_unread(struct mp3_session *s){
+	struct mp3_ring_header *ring;
+	u64 unread = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		ring = s->rings[cpu].header;
+		unread += min_t(u64, smp_load_acquire(&ring->producer) - READ_ONCE(ring->consumer), vbuffer_size_b);
+	}
+	return unread;
+}
+
+/**
+ * @brief mp3_ring_readable - Checks if the unread data of a session reached
+ * the watermark
+ * @param s - the session
+ * @return true if readers should be woken
+ */
+static bool mp3_ring_readable(struct mp3_session *s){
+	u64 watermark = (u64)max(READ_ONCE(wakeup_watermark), 1U) * sizeof(struct mp3_task_record);
+	return mp3_ring_unread(s) >= min_t(u64, watermark, vbuffer_size_b);
+}
+
+/**
+ * @brief mp3_pid_table_contains - Checks if a pid is in a table. Called by
+ * the tracepoint probes, so it only reads the table without the lock.
+ * @param t - the table
+ * @param pid - the pid
+ * @return true if it is in the table
+ */
+static bool mp3_pid_table_contains(struct mp3_pid_table *t, pid_t pid){
+	u32 i = hash_32(pid, PID_TABLE_BITS);
+	u32 n;
+	pid_t slot;
+
+	for(n = 0; n < ARRAY_SIZE(t->pids); n++){
+		slot = READ_ONCE(t->pids[i]);
+		if(slot == pid) return true;
+		if(!slot) return false;
+		i = (i + 1) & (ARRAY_SIZE(t->pids) - 1);
+	}
+	return false;
+}
+
+/**
+ * @brief mp3_pid_table_insert - Adds a pid to a table. Pids past the table
+ * size are left out, so their faults are not sampled and their forks and
+ * exits are not followed.
+ * @param t - the table
+ * @param pid - the pid
+ */
+static void mp3_pid_table_insert(struct mp3_pid_table *t, pid_t pid){
+	u32 i = hash_32(pid, PID_TABLE_BITS);
+	u32 n;
+
+	spin_lock(&t->lock);
+	//keep a free slot so lookups of unknown pids terminate
+	for(n = 0; n < ARRAY_SIZE(t->pids) - 1; n++){
+		if(t->pids[i] == pid) break;
+		if(!t->pids[i]){
+			WRITE_ONCE(t->pids[i], pid);
+			break;
+		}
+		i = (i + 1) & (ARRAY_SIZE(t->pids) - 1);
+	}
+	spin_unlock(&t->lock);
+}
+
+/**
+ * @brief mp3_pid_table_remove - Removes a pid from a table. The entries after
+ * it are shifted back, so the table needs no tombstones. A probe racing with
+ * the shift may miss the entry once.
+ * @param t - the table
+ * @param pid - the pid
+ */
+static void mp3_pid_table_remove(struct mp3_pid_table *t, pid_t pid){
+	u32 mask = ARRAY_SIZE(t->pids) - 1;
+	u32 i = hash_32(pid, PID_TABLE_BITS);
+	u32 j, home, n;
+
+	spin_lock(&t->lock);
+	for(n = 0; n < ARRAY_SIZE(t->pids) && t->pids[i] != pid; n++){
+		if(!t->pids[i]) break;
+		i = (i + 1) & mask;
+	}
+	if(t->pids[i] != pid){
+		spin_unlock(&t->lock);
+		return;
+	}
+	for(j = (i + 1) & mask; t->pids[j]; j = (j + 1) & mask){
+		home = hash_32(t->pids[j], PID_TABLE_BITS);
+		//move the entry into the hole unless its home slot lies after the hole
+		if(((j - home) & mask) >= ((j - i) & mask)){
+			WRITE_ONCE(t->pids[i], t->pids[j]);
+			i = j;
+		}
+	}
+	WRITE_ONCE(t->pids[i], 0);
+	spin_unlock(&t->lock);
+}
+
+/**
+ * @brief mp3_fault_probe - Probe of the page_fault_user tracepoint. Runs in
+ * the faulting task with preemption disabled, so it only stages the address on
+ * this cpu. The work function resolves and aggregates it. Only the faults of
+ * registered threads are sampled, and they are staged under their thread
+ * group, whose address space the heat histograms describe.
+ * @param data - unused
+ * @param address - faulting address
+ * @param regs - unused
+ * @param error_code - unused
+ */
+static void mp3_fault_probe(void *data, unsigned long address, struct pt_regs *regs, unsigned long error_code){
+	struct mp3_cpu *c;
+	struct mp3_fault_stage *stage;
+	unsigned int period = READ_ONCE(fault_sample_period);
+
+	//the table holds the tids of the registered threads
+	if(!period || !mp3_pid_table_contains(&registered_pids, current->pid)) return;
+	c = &mp3_cpus[smp_processor_id()];
+	if(++c->fault_tick % period) return;
+
+	stage = &c->stage;
+	spin_lock(&stage->lock);
+	if(stage->n < FAULT_STAGE_SIZE){
+		stage->samples[stage->n].pid = current->tgid;
+		stage->samples[stage->n].address = address;
+		stage->n++;
+	} else {
+		stage->dropped++;
+	}
+	spin_unlock(&stage->lock);
+}
+
+/**
+ * @brief mp3_fault_sampling_set_locked - Sets the fault sampling period and
+ * registers or unregisters the probe. The tracepoint is not exported, so it is
+ * looked up by name. Caller holds fault_mutex.
+ * @param period - sample one in this many faults, 0 to disable
+ * @return 0 on success
+ */
+static int mp3_fault_sampling_set_locked(unsigned int period){
+	int ret;
+
+	if(period && !fault_probe_registered){
+		if(!fault_tracepoint)
+			fault_tracepoint = (struct tracepoint *)kallsyms_lookup_name("__tracepoint_page_fault_user");
+		if(!fault_tracepoint){
+			printk(KERN_ALERT "MP3 could not find the page_fault_user tracepoint\n");
+			return -ENOSYS;
+		}
+		WRITE_ONCE(fault_sample_period, period);
+		ret = tracepoint_probe_register(fault_tracepoint, (void *)mp3_fault_probe, NULL);
+		if(ret){
+			WRITE_ONCE(fault_sample_period, 0);
+			return ret;
+		}
+		fault_probe_registered = true;
+	} else if(!period && fault_probe_registered){
+		tracepoint_probe_unregister(fault_tracepoint, (void *)mp3_fault_probe, NULL);
+		tracepoint_synchronize_unregister();
+		fault_probe_registered = false;
+	}
+	WRITE_ONCE(fault_sample_period, period);
+	return 0;
+}
+
+/**
+ * @brief mp3_get_task_mm - Finds the address space of a process
+ * @param pid - the process
+ * @return the mm with a reference held, release it with mmput. NULL if the
+ * process is gone.
+ */
+static struct mm_struct *mp3_get_task_mm(pid_t pid){
+	struct task_struct *task;
+	struct mm_struct *mm;
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	if(task) get_task_struct(task);
+	rcu_read_unlock();
+	if(!task) return NULL;
+	mm = get_task_mm(task);
+	put_task_struct(task);
+	return mm;
+}
+
+/**
+ * @brief mp3_heat_lookup_vma - Starts the histogram of the VMA a sampled
+ * address belongs to
+ * @param pid - the faulting process
+ * @param address - the sampled address
+ * @param heat - the histogram to fill in
+ * @return 0 on success, -ESRCH if the process is gone, -EFAULT if the address
+ * is not mapped any more
+ */
+static int mp3_heat_lookup_vma(pid_t pid, unsigned long address, struct mp3_heat *heat){
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	int ret = -EFAULT;
+
+	mm = mp3_get_task_mm(pid);
+	if(!mm) return -ESRCH;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, address);
+	if(vma && vma->vm_start <= address){
+		memset(heat, 0, sizeof(*heat));
+		heat->pid = pid;
+		heat->vm_start = vma->vm_start;
+		heat->vm_end = vma->vm_end;
+		heat->bucket_size = PAGE_ALIGN(DIV_ROUND_UP(vma->vm_end - vma->vm_start, MP3_HEAT_BUCKETS));
+		if(vma->vm_file)
+			heat->kind = MP3_HEAT_FILE;
+		else if(vma->vm_start <= mm->brk && vma->vm_end >= mm->start_brk)
+			heat->kind = MP3_HEAT_HEAP;
+		else if(vma->vm_start <= mm->start_stack && vma->vm_end >= mm->start_stack)
+			heat->kind = MP3_HEAT_STACK;
+		else
+			heat->kind = MP3_HEAT_ANON;
+		ret = 0;
+	}
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+	return ret;
+}
+
+/**
+ * @brief mp3_heat_add - Counts one sampled address in the histogram of its VMA
+ * @param c - the cpu whose histograms are updated
+ * @param pid - the faulting process
+ * @param address - the sampled address
+ * @return false if it was dropped because too many VMAs were hot
+ */
+static bool mp3_heat_add(struct mp3_cpu *c, pid_t pid, unsigned long address){
+	struct mp3_heat *heat;
+	unsigned int i;
+
+	for(i = 0; i < c->nheat; i++){
+		heat = &c->heat[i];
+		if(heat->pid == pid && address >= heat->vm_start && address < heat->vm_end) break;
+	}
+	if(i == c->nheat){
+		if(c->nheat == FAULT_HEAT_MAX) return false;
+		heat = &c->heat[c->nheat];
+		//faults of exited processes or unmapped addresses have no VMA to blame
+		if(mp3_heat_lookup_vma(pid, address, heat)) return true;
+		c->nheat++;
+	}
+	heat->buckets[(address - heat->vm_start) / heat->bucket_size]++;
+	heat->faults++;
+	return true;
+}
+
+/**
+ * @brief what a page table walk of a task collects
+ */
+struct mp3_scan {
+	bool young;     //count and clear the accessed bits
+	bool placement; //count the huge pages and the node of every page
+	int nid;        //node of the cpu the task last ran on
+	unsigned long young_pages;
+	unsigned long thp_pages;
+	unsigned long local;
+	unsigned long remote;
+};
+
+/**
+ * @brief mp3_scan_pages - Counts pages of one VMA that map the same node
+ * @param scan - the walk
+ * @param pfn - first frame of the pages
+ * @param n - number of pages
+ */
+static void mp3_scan_pages(struct mp3_scan *scan, unsigned long pfn, unsigned long n){
+	if(pfn_to_nid(pfn) == scan->nid) scan->local += n;
+	else scan->remote += n;
+}
+
+/**
+ * @brief mp3_page_referenced - Tests and clears the accessed bit of a page
+ * the way page_idle does: the secondary MMUs are asked too through the mmu
+ * notifiers, the TLB entry is flushed where the architecture needs it, and a
+ * referenced page is marked young so that reclaim still sees the access.
+ * Caller holds the page table lock.
+ * @param vma - the VMA of the page
+ * @param addr - address of the page
+ * @param pte - the pte mapping the page, NULL for a transparent huge page
+ * @param pmd - the pmd mapping the transparent huge page if pte is NULL
+ * @return whether the page was accessed since the previous scan
+ */
+static bool mp3_page_referenced(struct vm_area_struct *vma, unsigned long addr, pte_t *pte, pmd_t *pmd){
+	unsigned long size = pte ? PAGE_SIZE : HPAGE_PMD_SIZE;
+	unsigned long pfn = pte ? pte_pfn(*pte) : pmd_pfn(*pmd);
+	int young;
+
+	young = pte ? mp3_ptep_clear_flush_young(vma, addr, pte) : mp3_pmdp_clear_flush_young(vma, addr, pmd);
+#ifdef CONFIG_MMU_NOTIFIER
+	if(mm_has_notifiers(vma->vm_mm))
+		young |= mp3_mmu_notifier_clear_flush_young(vma->vm_mm, addr, addr + size);
+#endif
+	if(!young) return false;
+	if(pfn_valid(pfn)){
+		struct page *page = pfn_to_page(pfn);
+
+		clear_page_idle(page);
+		set_page_young(page);
+	}
+	return true;
+}
+
+/**
+ * @brief mp3_scan_pte_range - Walks the ptes of one pmd
+ * @param vma - the VMA the range belongs to
+ * @param pmd - the pmd mapping the range
+ * @param addr - start of the range
+ * @param end - end of the range, within the pmd
+ * @param scan - the walk
+ */
+static void mp3_scan_pte_range(struct vm_area_struct *vma, pmd_t *pmd, unsigned long addr, unsigned long end,
+							   struct mp3_scan *scan){
+	spinlock_t *ptl;
+	pte_t *start_pte, *pte;
+
+	start_pte = pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
+	for(; addr < end; pte++, addr += PAGE_SIZE){
+		if(!pte_present(*pte)) continue;
+		if(scan->young && mp3_page_referenced(vma, addr, pte, NULL)) scan->young_pages++;
+		if(scan->placement) mp3_scan_pages(scan, pte_pfn(*pte), 1);
+	}
+	pte_unmap_unlock(start_pte, ptl);
+}
+
+/**
+ * @brief mp3_scan_vma - Walks the page tables of one VMA
+ * @param vma - the VMA
+ * @param scan - the walk
+ */
+static void mp3_scan_vma(struct vm_area_struct *vma, struct mp3_scan *scan){
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long addr, next;
+	spinlock_t *ptl;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	for(addr = vma->vm_start; addr < vma->vm_end; addr = next){
+		next = pmd_addr_end(addr, vma->vm_end);
+		pgd = pgd_offset(mm, addr);
+		if(pgd_none(*pgd) || pgd_bad(*pgd)) continue;
+		pud = pud_offset(pgd, addr);
+		if(pud_none(*pud) || pud_bad(*pud)) continue;
+		pmd = pmd_offset(pud, addr);
+
+		//a transparent huge page has one accessed bit for the whole pmd
+		if(pmd_trans_huge(*pmd)){
+			ptl = pmd_lock(mm, pmd);
+			if(pmd_trans_huge(*pmd)){
+				if(scan->young && mp3_page_referenced(vma, addr & HPAGE_PMD_MASK, NULL, pmd))
+					scan->young_pages += HPAGE_PMD_NR;
+				if(scan->placement){
+					scan->thp_pages += HPAGE_PMD_NR;
+					mp3_scan_pages(scan, pmd_pfn(*pmd), HPAGE_PMD_NR);
+				}
+			}
+			spin_unlock(ptl);
+			continue;
+		}
+		if(pmd_none(*pmd) || pmd_bad(*pmd)) continue;
+		mp3_scan_pte_range(vma, pmd, addr, next, scan);
+	}
+}
+
+/**
+ * @brief mp3_scan_mm - Samples the memory counters of a process: its
+ * resident and swapped pages, and if enabled its working set (the pages
+ * accessed since the previous scan, whose accessed bits are cleared for the
+ * next one), its huge pages and the nodes its pages are on
+ * @param pid - the process
+ * @param sample - the counters to fill in, the fields of the sampled ones are set
+ */
+static void mp3_scan_mm(pid_t pid, struct mp3_counters *sample){
+	struct task_struct *task;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	struct mp3_scan scan = {
+		.young = READ_ONCE(wss_sample) && wss_available,
+		.placement = READ_ONCE(placement_sample),
+		.nid = NUMA_NO_NODE,
+	};
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	if(task) scan.nid = cpu_to_node(task_cpu(task));
+	rcu_read_unlock();
+
+	mm = mp3_get_task_mm(pid);
+	if(!mm) return;
+	sample->rss_pages = get_mm_rss(mm);
+	sample->swap_pages = get_mm_counter(mm, MM_SWAPENTS);
+	sample->fields |= MP3_FIELD_RSS | MP3_FIELD_SWAP;
+
+	if(scan.young || scan.placement){
+		down_read(&mm->mmap_sem);
+		for(vma = mm->mmap; vma; vma = vma->vm_next){
+			if(vma->vm_flags & (VM_IO | VM_PFNMAP) || is_vm_hugetlb_page(vma)) continue;
+			mp3_scan_vma(vma, &scan);
+			cond_resched();
+		}
+		up_read(&mm->mmap_sem);
+	}
+	mmput(mm);
+
+	if(scan.young){
+		sample->wss_pages = scan.young_pages;
+		sample->fields |= MP3_FIELD_WSS;
+	}
+	if(scan.placement){
+		sample->thp_pages = scan.thp_pages;
+		sample->numa_local = scan.local;
+		sample->numa_remote = scan.remote;
+		sample->fields |= MP3_FIELD_THP | MP3_FIELD_NUMA;
+	}
+}
+
+/**
+ * @brief mp3_counters_add - Adds the counters of one task to a total
+ * @param total - the total
+ * @param sample - the counters of the task
+ */
+static void mp3_counters_add(struct mp3_counters *total, const struct mp3_counters *sample){
+	total->fields |= sample->fields;
+	total->min_flt += sample->min_flt;
+	total->maj_flt += sample->maj_flt;
+	total->cpu_time += sample->cpu_time;
+	total->wss_pages += sample->wss_pages;
+	total->rss_pages += sample->rss_pages;
+	total->swap_pages += sample->swap_pages;
+	total->thp_pages += sample->thp_pages;
+	total->numa_local += sample->numa_local;
+	total->numa_remote += sample->numa_remote;
+}
+
+/**
+ * @brief mp3_thp_faults - Sets the huge page faults of the whole system
+ * since the previous call. Only called by the last cpu of a round. The first
+ * call only takes the baseline.
+ * @param total - the counters of the aggregate record
+ */
+static void mp3_thp_faults(struct mp3_counters *total){
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && defined(CONFIG_VM_EVENT_COUNTERS)
+	static unsigned long events[NR_VM_EVENT_ITEMS];
+	static unsigned long prev_alloc, prev_fallback;
+	static bool primed;
+
+	all_vm_events(events);
+	if(primed){
+		total->thp_faults = events[THP_FAULT_ALLOC] - prev_alloc;
+		total->thp_fallbacks = events[THP_FAULT_FALLBACK] - prev_fallback;
+		total->fields |= MP3_FIELD_THP_FAULTS;
+	}
+	prev_alloc = events[THP_FAULT_ALLOC];
+	prev_fallback = events[THP_FAULT_FALLBACK];
+	primed = true;
+#endif
+}
+
+/**
+ * @brief mp3_update_use - Sets the counters of a task to their change since
+ * the last sample. The kernel counters are only read, so /proc/<pid>/stat,
+ * getrusage and other profilers still see the real totals.
+ * @param tmp - the task
+ * @return 0 on success, -1 if the task is gone
+ */
+static int mp3_update_use(mp3_task_struct *tmp){
+	unsigned long min_flt, maj_flt, utime, stime;
+
+	if(get_cpu_use(tmp->pid, &min_flt, &maj_flt, &utime, &stime)) return -1;
+	tmp->minor_fault = min_flt - tmp->prev_minor_fault;
+	tmp->major_fault = maj_flt - tmp->prev_major_fault;
+	tmp->utime = utime - tmp->prev_utime;
+	tmp->stime = stime - tmp->prev_stime;
+	tmp->prev_minor_fault = min_flt;
+	tmp->prev_major_fault = maj_flt;
+	tmp->prev_utime = utime;
+	tmp->prev_stime = stime;
+	return 0;
+}
+
+/**
+ * @brief mp3_record_stamp - Fills the header of a record being written, and
+ * stamps it with the time it is sampled at and how late that is against the
+ * expiry of the sampling timer that started the round
+ * @param hdr - the header
+ * @param type - the record type
+ * @param size - size of the record
+ * @param now - jiffies of the sample
+ * @param pid - pid the record is about
+ */
+static void mp3_record_stamp(struct mp3_record_header *hdr, u16 type, u16 size, unsigned long now, pid_t pid){
+	hdr->type = type;
+	hdr->size = size;
+	hdr->pid = pid;
+	hdr->jiffies = now;
+	hdr->time_ns = ktime_get_ns();
+	hdr->jitter_ns = (s64)(hdr->time_ns - READ_ONCE(round_expected_ns));
+}
+
+/**
+ * @brief mp3_put_sample - Writes one task record into the ring of a cpu
+ * @param r - the ring of the cpu in the session of the task
+ * @param type - MP3_RECORD_TASK or MP3_RECORD_AGGREGATE
+ * @param now - jiffies of the sample
+ * @param pid - pid of the task, MP3_AGGREGATE_PID for the aggregate
+ * @param sample - the counters
+ */
+static void mp3_put_sample(struct mp3_ring *r, u16 type, unsigned long now, pid_t pid, const struct mp3_counters *sample){
+	struct mp3_task_record *record = mp3_ring_reserve(r, sizeof(struct mp3_task_record));
+	if(!record) return;
+	mp3_record_stamp(&record->hdr, type, sizeof(struct mp3_task_record), now, pid);
+	record->min_flt = sample->min_flt;
+	record->maj_flt = sample->maj_flt;
+	record->cpu_time = sample->cpu_time;
+	record->wss_pages = sample->wss_pages;
+	record->fields = sample->fields;
+	record->rss_pages = sample->rss_pages;
+	record->swap_pages = sample->swap_pages;
+	record->thp_pages = sample->thp_pages;
+	record->numa_local = sample->numa_local;
+	record->numa_remote = sample->numa_remote;
+	record->thp_faults = sample->thp_faults;
+	record->thp_fallbacks = sample->thp_fallbacks;
+	mp3_ring_commit(r);
+}
+
+/**
+ * @brief mp3_put_heat - Writes the heat records of the addresses staged on a
+ * cpu since the last sample into its ring of the shared session, whose tasks
+ * the fault probe samples. Called from the work of the cpu only, which owns
+ * its heat table.
+ * @param c - the cpu
+ * @param now - jiffies of the sample
+ */
+static void mp3_put_heat(struct mp3_cpu *c, unsigned long now){
+	struct mp3_ring *r = &shared_session.rings[c->cpu];
+	struct mp3_heat_record *record;
+	struct mp3_heat *heat;
+	unsigned long dropped, taken = 0;
+	unsigned int i, n;
+
+	//VMA lookups sleep, so only move the samples under the lock
+	spin_lock(&c->stage.lock);
+	n = c->stage.n;
+	memcpy(c->scratch, c->stage.samples, n * sizeof(struct mp3_fault_sample));
+	c->stage.n = 0;
+	dropped = c->stage.dropped;
+	c->stage.dropped = 0;
+	spin_unlock(&c->stage.lock);
+
+	for(i = 0; i < n; i++){
+		if(mp3_heat_add(c, c->scratch[i].pid, c->scratch[i].address)) taken++;
+		else dropped++;
+	}
+
+	for(i = 0; i < c->nheat; i++){
+		heat = &c->heat[i];
+		record = mp3_ring_reserve(r, sizeof(struct mp3_heat_record));
+		if(!record) continue;
+		mp3_record_stamp(&record->hdr, MP3_RECORD_HEAT, sizeof(struct mp3_heat_record), now, heat->pid);
+		record->vm_start = heat->vm_start;
+		record->vm_end = heat->vm_end;
+		record->bucket_size = heat->bucket_size;
+		record->faults = heat->faults;
+		record->kind = heat->kind;
+		memcpy(record->buckets, heat->buckets, sizeof(record->buckets));
+		mp3_ring_commit(r);
+	}
+	c->nheat = 0;
+
+	r->header->fault_samples += taken;
+	r->header->fault_overrun += dropped;
+}
+
+/**
+ * @brief mp3_signal_task - Sends a signal to a registered task
+ * @param pid - the task
+ * @param sig - SIGSTOP or SIGCONT
+ * @return 0 on success, -ESRCH if the task is gone
+ */
+static int mp3_signal_task(pid_t pid, int sig){
+	struct pid *p;
+	int ret = -ESRCH;
+
+	rcu_read_lock();
+	p = find_vpid(pid);
+	if(p) ret = kill_pid(p, sig, 1);
+	rcu_read_unlock();
+	return ret;
+}
+
+/**
+ * @brief mp3_task_nice - The nice value of a registered task
+ * @param pid - the task
+ * @return its nice value, MIN_NICE - 1 if it is gone
+ */
+static int mp3_task_nice(pid_t pid){
+	struct task_struct *task;
+	int nice = MIN_NICE - 1;
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	if(task) nice = task_nice(task);
+	rcu_read_unlock();
+	return nice;
+}
+
+/**
+ * @brief mp3_put_control - Writes one thrashing control decision into the
+ * ring of a cpu in the shared session
+ * @param c - the cpu
+ * @param now - jiffies of the sample
+ * @param tgid - the thread group suspended or resumed
+ * @param action - MP3_CONTROL_SUSPEND or MP3_CONTROL_RESUME
+ * @param running - thread groups left running after the decision
+ * @param suspended - thread groups suspended after the decision
+ * @param util_pct - cpu utilization of the sample
+ * @param maj_rate - major faults per second of the sample
+ */
+static void mp3_put_control(struct mp3_cpu *c, unsigned long now, pid_t tgid, u32 action, unsigned int running, unsigned int suspended, u32 util_pct, u64 maj_rate){
+	struct mp3_ring *r = &shared_session.rings[c->cpu];
+	struct mp3_control_record *record = mp3_ring_reserve(r, sizeof(struct mp3_control_record));
+
+	if(!record) return;
+	mp3_record_stamp(&record->hdr, MP3_RECORD_CONTROL, sizeof(struct mp3_control_record), now, tgid);
+	record->action = action;
+	record->running = running;
+	record->suspended = suspended;
+	record->util_pct = util_pct;
+	record->maj_rate = maj_rate;
+	record->threshold = READ_ONCE(thrash_fault_rate);
+	mp3_ring_commit(r);
+}
+
+/**
+ * @brief one thread group of the shared session, as the thrashing controller
+ * sees it: SIGSTOP and SIGCONT act on whole groups
+ */
+struct mp3_thrash_group {
+	pid_t tgid;
+	int nice;
+	unsigned long seq;
+	unsigned long suspended_at;
+	bool suspended;
+};
+
+static int mp3_thrash_group_cmp(const void *a, const void *b){
+	const struct mp3_thrash_group *x = a, *y = b;
+
+	return x->tgid < y->tgid ? -1 : x->tgid > y->tgid;
+}
+
+/**
+ * @brief mp3_thrash_groups - Collects the thread groups of the tasks of the
+ * shared session. A group takes the highest nice value and the last
+ * registration of its tasks, and is suspended if its tasks are.
+ * Caller holds register_mutex, so tasks can only leave meanwhile.
+ * @param groups - set to the groups, freed by the caller
+ * @param running - set to the number of running groups
+ * @return number of groups, or -ENOMEM
+ */
+static int mp3_thrash_groups(struct mp3_thrash_group **groups, unsigned int *running){
+	struct mp3_thrash_group *g;
+	mp3_task_struct *tmp;
+	int cpu, i, n = 0, size = atomic_read(&shared_session.num_entries);
+
+	*groups = NULL;
+	*running = 0;
+	if(size <= 0) return 0;
+	g = kmalloc_array(size, sizeof(*g), GFP_KERNEL);
+	if(!g) return -ENOMEM;
+
+	for_each_possible_cpu(cpu){
+		mutex_lock(&mp3_cpus[cpu].lock);
+		list_for_each_entry(tmp, &mp3_cpus[cpu].tasks, task_node){
+			if(tmp->session != &shared_session || n == size) continue;
+			g[n].tgid = tmp->tgid;
+			g[n].nice = tmp->suspended ? MIN_NICE - 1 : mp3_task_nice(tmp->pid);
+			g[n].seq = tmp->seq;
+			g[n].suspended_at = tmp->suspended_at;
+			g[n].suspended = tmp->suspended;
+			n++;
+		}
+		mutex_unlock(&mp3_cpus[cpu].lock);
+	}
+
+	//merge the tasks of every group into its first entry
+	sort(g, n, sizeof(*g), mp3_thrash_group_cmp, NULL);
+	for(i = 1, size = n, n = n ? 1 : 0; i < size; i++){
+		struct mp3_thrash_group *last = &g[n - 1];
+
+		if(g[i].tgid != last->tgid){
+			g[n++] = g[i];
+			continue;
+		}
+		last->nice = max(last->nice, g[i].nice);
+		last->seq = max(last->seq, g[i].seq);
+		if(g[i].suspended && (!last->suspended || time_before(g[i].suspended_at, last->suspended_at)))
+			last->suspended_at = g[i].suspended_at;
+		last->suspended |= g[i].suspended;
+	}
+	for(i = 0; i < n; i++){
+		if(!g[i].suspended) (*running)++;
+	}
+	*groups = g;
+	return n;
+}
+
+/**
+ * @brief mp3_thrash_mark - Marks every task of a thread group of the shared
+ * session suspended or running. Caller holds register_mutex.
+ * @param tgid - the thread group
+ * @param suspended - the new state
+ */
+static void mp3_thrash_mark(pid_t tgid, bool suspended){
+	mp3_task_struct *tmp;
+	unsigned long now = jiffies;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		mutex_lock(&mp3_cpus[cpu].lock);
+		list_for_each_entry(tmp, &mp3_cpus[cpu].tasks, task_node){
+			if(tmp->tgid != tgid || tmp->session != &shared_session || tmp->suspended == suspended) continue;
+			tmp->suspended = suspended;
+			tmp->suspended_at = now;
+			if(suspended) atomic_inc(&thrash_suspended);
+			else atomic_dec(&thrash_suspended);
+		}
+		mutex_unlock(&mp3_cpus[cpu].lock);
+	}
+}
+
+/**
+ * @brief mp3_thrash_suspend - Stops the running thread group with the lowest
+ * priority: the highest nice value, and of those the last registered. The
+ * last running group is never stopped.
+ * @param running - set to the groups left running
+ * @param suspended - set to the groups suspended
+ * @return the tgid of the stopped group, 0 if there was none to stop
+ */
+static pid_t mp3_thrash_suspend(unsigned int *running, unsigned int *suspended){
+	struct mp3_thrash_group *groups, *victim = NULL;
+	pid_t tgid = 0;
+	int i, n;
+
+	//register_mutex keeps an unregistration from missing the SIGCONT, and a
+	//freed victim from being registered again in between
+	mutex_lock(&register_mutex);
+	n = mp3_thrash_groups(&groups, running);
+	for(i = 0; i < n; i++){
+		if(groups[i].suspended) continue;
+		if(!victim || groups[i].nice > victim->nice || (groups[i].nice == victim->nice && groups[i].seq > victim->seq))
+			victim = &groups[i];
+	}
+	if(*running >= 2 && !mp3_signal_task(victim->tgid, SIGSTOP)){
+		tgid = victim->tgid;
+		mp3_thrash_mark(tgid, true);
+		(*running)--;
+	}
+	*suspended = max(n, 0) - *running;
+	mutex_unlock(&register_mutex);
+	kfree(groups);
+	return tgid;
+}
+
+/**
+ * @brief mp3_thrash_resume - Continues the thread group that has been
+ * suspended the longest
+ * @param running - set to the groups left running
+ * @param suspended - set to the groups still suspended
+ * @return the tgid of the continued group, 0 if none is suspended
+ */
+static pid_t mp3_thrash_resume(unsigned int *running, unsigned int *suspended){
+	struct mp3_thrash_group *groups, *oldest = NULL;
+	pid_t tgid = 0;
+	int i, n;
+
+	mutex_lock(&register_mutex);
+	n = mp3_thrash_groups(&groups, running);
+	for(i = 0; i < n; i++){
+		if(groups[i].suspended && (!oldest || time_before(groups[i].suspended_at, oldest->suspended_at)))
+			oldest = &groups[i];
+	}
+	if(oldest){
+		tgid = oldest->tgid;
+		mp3_signal_task(tgid, SIGCONT);
+		mp3_thrash_mark(tgid, false);
+		(*running)++;
+	}
+	*suspended = max(n, 0) - *running;
+	mutex_unlock(&register_mutex);
+	kfree(groups);
+	return tgid;
+}
+
+/**
+ * @brief mp3_thrash_control - The thrashing controller, run by the last cpu
+ * of every round. The tasks thrash when their major fault rate is above
+ * thrash_fault_rate while they use less than thrash_util_pct of the cpus:
+ * they wait on the disk instead of running. After thrash_window such samples
+ * the lowest priority thread group is stopped, which frees its memory for the
+ * others, and after thrash_window samples below half the fault rate the group
+ * stopped the longest is continued. One group is stopped or continued at a
+ * time, so the load converges on what fits in memory. Every decision is
+ * written into the ring.
+ * @param c - the last cpu of the round
+ * @param now - jiffies of the sample
+ * @param major_fault - major faults of all tasks during the interval
+ * @param utilization - cpu time of all tasks during the interval
+ */
+static void mp3_thrash_control(struct mp3_cpu *c, unsigned long now, unsigned long major_fault, unsigned long utilization){
+	u64 interval_us = mp3_sample_interval();
+	u64 maj_rate = div64_u64((u64)major_fault * USEC_PER_SEC, interval_us);
+	u32 util_pct = div64_u64((u64)jiffies_to_usecs(utilization) * 100, interval_us * num_online_cpus());
+	u64 threshold = READ_ONCE(thrash_fault_rate);
+	unsigned int window = max(READ_ONCE(thrash_window), 1U);
+	unsigned int running, suspended;
+	pid_t tgid;
+
+	//when the controller is turned off, give back every stopped task
+	if(!READ_ONCE(thrash_control)){
+		thrash_hot_rounds = thrash_calm_rounds = 0;
+		while(atomic_read(&thrash_suspended) && (tgid = mp3_thrash_resume(&running, &suspended)))
+			mp3_put_control(c, now, tgid, MP3_CONTROL_RESUME, running, suspended, util_pct, maj_rate);
+		return;
+	}
+
+	if(maj_rate >= threshold && util_pct < READ_ONCE(thrash_util_pct)){
+		thrash_hot_rounds++;
+		thrash_calm_rounds = 0;
+	} else if(maj_rate < threshold / 2){
+		thrash_calm_rounds++;
+		thrash_hot_rounds = 0;
+	} else {
+		thrash_hot_rounds = thrash_calm_rounds = 0;
+	}
+
+	if(thrash_hot_rounds >= window){
+		thrash_hot_rounds = 0;
+		tgid = mp3_thrash_suspend(&running, &suspended);
+		if(tgid){
+			printk(KERN_ALERT "Thrashing at %llu major faults/s and %u%% cpu, suspended TGID:%u\n", maj_rate, util_pct, tgid);
+			mp3_put_control(c, now, tgid, MP3_CONTROL_SUSPEND, running, suspended, util_pct, maj_rate);
+		}
+	} else if(thrash_calm_rounds >= window && atomic_read(&thrash_suspended)){
+		thrash_calm_rounds = 0;
+		tgid = mp3_thrash_resume(&running, &suspended);
+		if(tgid){
+			printk(KERN_ALERT "Recovered at %llu major faults/s, resumed TGID:%u\n", maj_rate, tgid);
+			mp3_put_control(c, now, tgid, MP3_CONTROL_RESUME, running, suspended, util_pct, maj_rate);
+		}
+	}
+}
+
+/**
+ * @brief mp3_sessions_update - Refreshes the header of every session at the
+ * end of a round and wakes the readers of the sessions that reached the
+ * watermark
+ * @param round_end - whether the last cpu of the round calls it
+ */
+static void mp3_sessions_update(bool round_end){
+	struct mp3_session *s;
+	unsigned long flags;
+	s64 real_offset = ktime_get_real_ns() - ktime_get_ns();
+
+	spin_lock_irqsave(&session_lock, flags);
+	list_for_each_entry(s, &sessions, node){
+		if(round_end){
+			s->header->sample_interval_us = mp3_session_interval(s);
+			WRITE_ONCE(s->header->real_offset_ns, real_offset);
+		}
+		if(mp3_ring_readable(s))
+			wake_up_interruptible(&s->wait);
+	}
+	spin_unlock_irqrestore(&session_lock, flags);
+}
+
+/**
+ * @brief mp3_work_func - The sampler of one cpu. Cycles through the tasks of
+ * the cpu, updates the page fault and utilization counts of the tasks whose
+ * session is due, samples the memory counters and writes one record per task
+ * into the ring of the cpu in its session, followed by the heat records of
+ * the faults staged on it. The last cpu to finish a round writes the
+ * aggregate record of the tasks of the shared session, if enabled, and runs
+ * the thrashing controller on them.
+ * @param work - the work of the cpu
+ */
+static void mp3_work_func(struct work_struct *work){
+	struct mp3_cpu *c = container_of(work, struct mp3_cpu, work);
+	struct list_head *pos;
+	struct list_head *q;
+
+	unsigned long now = READ_ONCE(round_jiffies_now);
+	bool shared_due = READ_ONCE(shared_session.due);
+	struct mp3_counters total;
+
+	memset(&total, 0, sizeof(total));
+
+	mutex_lock(&c->lock);
+	list_for_each_safe(pos, q, &c->tasks){
+		mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
+		if(!READ_ONCE(tmp->session->due)) continue;
+		//If task valid, update use. Otherwise, remove from list.
+		if(!mp3_update_use(tmp)){
+			memset(&tmp->sample, 0, sizeof(tmp->sample));
+			tmp->sample.min_flt = tmp->minor_fault;
+			tmp->sample.maj_flt = tmp->major_fault;
+			tmp->sample.cpu_time = tmp->utime + tmp->stime;
+			mp3_scan_mm(tmp->pid, &tmp->sample);
+			if(tmp->session == &shared_session) mp3_counters_add(&total, &tmp->sample);
+			mp3_put_sample(&tmp->session->rings[c->cpu], MP3_RECORD_TASK, now, tmp->pid, &tmp->sample);
+		} else {
+			printk(KERN_ALERT "Can not find CPU use for unknown PID: %u, deleting it\n", tmp->pid);
+			list_del(pos);
+			c->num_entries--;
+			atomic_dec(&num_entries);
+			atomic_dec(&tmp->session->num_entries);
+			if(tmp->suspended) atomic_dec(&thrash_suspended);
+			if(tmp->session == &shared_session) mp3_pid_table_remove(&registered_pids, tmp->pid);
+			kfree(tmp);
+		}
+	}
+	mutex_unlock(&c->lock);
+
+	if(READ_ONCE(fault_probe_registered))
+		mp3_put_heat(c, now);
+
+	spin_lock(&round_lock);
+	mp3_counters_add(&round_total, &total);
+	spin_unlock(&round_lock);
+	if(!atomic_dec_and_test(&round_pending)){
+		mp3_sessions_update(false);
+		return;
+	}
+	//the other cpus of the round are done, but take the lock for their stores
+	spin_lock(&round_lock);
+	total = round_total;
+	memset(&round_total, 0, sizeof(round_total));
+	spin_unlock(&round_lock);
+	if(shared_due){
+		mp3_thp_faults(&total);
+		if(aggregate_sample)
+			mp3_put_sample(&shared_session.rings[c->cpu], MP3_RECORD_AGGREGATE, now, MP3_AGGREGATE_PID, &total);
+		mp3_thrash_control(c, now, total.maj_flt, total.cpu_time);
+	}
+	mp3_sessions_update(true);
+}
+
 
-//vbuffer
-static uint8_t *vbuffer;
+/**
+ * @brief mp3_add_task - Hands a new task to the online cpu that samples the
+ * fewest tasks. If that cpu goes offline later, the timer queues its work on
+ * an online cpu instead. Starts the sampling timer on the first registration.
+ * Caller holds register_mutex.
+ * @param tmp - the task, with its session set
+ */
+static void mp3_add_task(mp3_task_struct *tmp){
+	struct mp3_cpu *c = NULL;
+	mp3_task_struct *other;
+	int cpu;
+
+	//a new thread of a group the thrashing controller stopped is stopped too
+	if(tmp->session == &shared_session){
+		for_each_possible_cpu(cpu){
+			mutex_lock(&mp3_cpus[cpu].lock);
+			list_for_each_entry(other, &mp3_cpus[cpu].tasks, task_node){
+				if(other->tgid != tmp->tgid || other->session != &shared_session || !other->suspended) continue;
+				tmp->suspended = true;
+				tmp->suspended_at = other->suspended_at;
+			}
+			mutex_unlock(&mp3_cpus[cpu].lock);
+		}
+		if(tmp->suspended) atomic_inc(&thrash_suspended);
+	}
 
-//workqueue things
-static struct workqueue_struct *queue;
+	for_each_online_cpu(cpu){
+		if(!c || mp3_cpus[cpu].num_entries < c->num_entries) c = &mp3_cpus[cpu];
+	}
+	tmp->seq = ++register_seq;
+	atomic_inc(&tmp->session->num_entries);
+	mutex_lock(&c->lock);
+	list_add(&(tmp->task_node), &c->tasks);
+	c->num_entries++;
+	mutex_unlock(&c->lock);
+	if(tmp->session == &shared_session) mp3_pid_table_insert(&registered_pids, tmp->pid);
+
+	if(atomic_inc_return(&num_entries) == 1)
+		hrtimer_start(&sample_timer, ns_to_ktime((u64)mp3_session_interval(tmp->session) * NSEC_PER_USEC), HRTIMER_MODE_REL);
+}
 
-//character device driver
-static dev_t mp3_dev;
-struct cdev mp3_cdev;
+/**
+ * @brief mp3_remove_task - Removes a task from the cpu that samples it, and
+ * continues its thread group if the thrashing controller had stopped it.
+ * Removing the leader of a thread group stops following the group.
+ * Caller holds register_mutex.
+ * @param pid - the pid of the task
+ * @param group - remove any one task of the thread group of pid instead
+ * @param session - the session the task is registered in
+ * @return the removed task, NULL if it is not registered
+ */
+static mp3_task_struct *mp3_remove_task(pid_t pid, bool group, struct mp3_session *session){
+	struct list_head *pos;
+	struct mp3_cpu *c;
+	int cpu;
 
-//task list variables
-unsigned num_entries;
-mp3_task_struct head;
+	for_each_possible_cpu(cpu){
+		c = &mp3_cpus[cpu];
+		mutex_lock(&c->lock);
+		list_for_each(pos, &c->tasks){
+			mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
+			if(tmp->session == session && (group ? tmp->tgid == pid : tmp->pid == pid)){
+				list_del(pos);
+				c->num_entries--;
+				if(tmp->suspended) atomic_dec(&thrash_suspended);
+				mutex_unlock(&c->lock);
+				//the rest of the group runs again as well
+				if(tmp->suspended){
+					mp3_signal_task(tmp->tgid, SIGCONT);
+					mp3_thrash_mark(tmp->tgid, false);
+				}
+				atomic_dec(&num_entries);
+				atomic_dec(&session->num_entries);
+				if(session != &shared_session) return tmp;
+				mp3_pid_table_remove(&registered_pids, tmp->pid);
+				if(tmp->pid == tmp->tgid){
+					mp3_pid_table_remove(&follow_threads, tmp->tgid);
+					mp3_pid_table_remove(&follow_children, tmp->tgid);
+				}
+				return tmp;
+			}
+		}
+		mutex_unlock(&c->lock);
+	}
+	return NULL;
+}
 
-unsigned vbuffer_idx;
+/**
+ * @brief mp3_task_registered - Checks if a task is registered in a session.
+ * Caller holds register_mutex.
+ * @param pid - the pid of the task
+ * @param session - the session
+ * @return true if it is registered
+ */
+static bool mp3_task_registered(pid_t pid, struct mp3_session *session){
+	mp3_task_struct *tmp;
+	bool found = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		mutex_lock(&mp3_cpus[cpu].lock);
+		list_for_each_entry(tmp, &mp3_cpus[cpu].tasks, task_node){
+			if(tmp->pid == pid && tmp->session == session){
+				found = true;
+				break;
+			}
+		}
+		mutex_unlock(&mp3_cpus[cpu].lock);
+		if(found) break;
+	}
+	return found;
+}
 
-//mutexes
-struct mutex task_struct_mutex;
+/**
+ * @brief mp3_register_pid_locked - Registers one task, unless it already is.
+ * The first sample counts from the registration on. A task can be
+ * registered in several sessions, each samples it on its own.
+ * Caller holds register_mutex.
+ * @param pid - the pid of the task
+ * @param session - the session to register it in
+ * @return 0 on success, -EEXIST if it is registered, -ESRCH if it is gone
+ */
+static int mp3_register_pid_locked(pid_t pid, struct mp3_session *session){
+	mp3_task_struct *tmp;
+	struct task_struct *task;
+
+	if(mp3_task_registered(pid, session)) return -EEXIST;
+	tmp = kzalloc(sizeof(mp3_task_struct), GFP_KERNEL);
+	if(!tmp) return -ENOMEM;
+	tmp->pid = pid;
+	tmp->session = session;
+	if(get_cpu_use(pid, &tmp->prev_minor_fault, &tmp->prev_major_fault, &tmp->prev_utime, &tmp->prev_stime)){
+		kfree(tmp);
+		return -ESRCH;
+	}
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	tmp->linux_task = task;
+	tmp->tgid = task ? task_tgid_vnr(task) : pid;
+	rcu_read_unlock();
+	INIT_LIST_HEAD(&tmp->task_node);
+	mp3_add_task(tmp);
+	return 0;
+}
 
 /**
- * @brief find_mp3_task_struct_by_pid Finds the mp3_task_struct in the linked list
- * based on the provided pid.
- * @param pid - the pid of the mp3_task_struct to find
- * @return pointer to the mp3_task_struct
+ * @brief mp3_thread_ids - Lists the threads of a thread group
+ * @param tgid - the thread group
+ * @param tids - set to the array of thread ids, free it with kfree
+ * @return number of threads, -ESRCH if the group is gone
  */
-mp3_task_struct * find_mp3_task_struct_by_pid(pid_t pid){
-	struct list_head * pos;
-	mutex_lock(&task_struct_mutex);
-	list_for_each(pos, &head.task_node){
-		mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
-		if(tmp->pid == pid){
-			mutex_unlock(&task_struct_mutex);
-			return tmp;
+static int mp3_thread_ids(pid_t tgid, pid_t **tids){
+	struct task_struct *task, *t;
+	int n = 0, max = 0;
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(tgid), PIDTYPE_PID);
+	//leave room for threads created meanwhile, the fork probe catches the rest
+	if(task) max = get_nr_threads(task) + 16;
+	rcu_read_unlock();
+	if(!max) return -ESRCH;
+
+	*tids = kmalloc_array(max, sizeof(pid_t), GFP_KERNEL);
+	if(!*tids) return -ENOMEM;
+	rcu_read_lock();
+	task = pid_task(find_vpid(tgid), PIDTYPE_PID);
+	if(task){
+		for_each_thread(task, t){
+			if(n == max) break;
+			(*tids)[n++] = task_pid_vnr(t);
 		}
 	}
-	mutex_unlock(&task_struct_mutex);
-	return NULL;
+	rcu_read_unlock();
+	return n;
 }
 
-static void mp3_work_func(struct work_struct *work);
+/**
+ * @brief mp3_follow_stage - Stages a fork or exit for the follow work.
+ * Called by the probes with preemption disabled.
+ * @param event - the fork or exit
+ */
+static void mp3_follow_stage(struct mp3_follow_event *event){
+	spin_lock(&follow_queue.lock);
+	if(follow_queue.n < FOLLOW_QUEUE_SIZE) follow_queue.events[follow_queue.n++] = *event;
+	else follow_queue.dropped++;
+	spin_unlock(&follow_queue.lock);
+	schedule_work(&follow_work);
+}
 
-DECLARE_DELAYED_WORK(mp3_deplayed_work, mp3_work_func);
 /**
- * @brief mp3_work_func - This function cycles through the workstruct list, and
- * updates the page fault and utilization counts
- * @param work - ignored
+ * @brief mp3_fork_probe - Probe of the sched_process_fork tracepoint, which
+ * fires for new threads and new processes alike. Runs in the parent with
+ * preemption disabled, so it only stages the child for the follow work.
+ * @param data - unused
+ * @param parent - the forking task
+ * @param child - the new task
  */
-static void mp3_work_func(struct work_struct *work){
-	struct list_head *pos;
-	struct list_head *q;
+static void mp3_fork_probe(void *data, struct task_struct *parent, struct task_struct *child){
+	struct mp3_follow_event event = { .pid = child->pid, .flags = 0, .exit = false };
+
+	if(!thread_group_leader(child)){
+		if(!mp3_pid_table_contains(&follow_threads, child->tgid)) return;
+	} else {
+		if(!mp3_pid_table_contains(&follow_children, parent->tgid)) return;
+		event.flags = MP3_REGISTER_CHILDREN;
+		if(mp3_pid_table_contains(&follow_threads, parent->tgid)) event.flags |= MP3_REGISTER_THREADS;
+	}
+	mp3_follow_stage(&event);
+}
+
+/**
+ * @brief mp3_exit_probe - Probe of the sched_process_exit tracepoint. Stages
+ * registered tasks for removal, so they leave as soon as they exit instead of
+ * at the next failed sample.
+ * @param data - unused
+ * @param p - the exiting task
+ */
+static void mp3_exit_probe(void *data, struct task_struct *p){
+	struct mp3_follow_event event = { .pid = p->pid, .flags = 0, .exit = true };
 
-	unsigned long total_major_fault = 0;
-	unsigned long total_minor_fault = 0;
-	unsigned long total_utilization = 0;
+	if(mp3_pid_table_contains(&registered_pids, p->pid)) mp3_follow_stage(&event);
+}
 
-	if(!num_entries){
-		vbuffer_idx = 0;
-		return;
+/**
+ * @brief mp3_follow_probes_enable_locked - Registers the fork and exit probes
+ * on the first registration that follows threads or children. The
+ * tracepoints are not exported, so they are looked up by name. They stay
+ * registered until the module is unloaded.
+ * Caller holds register_mutex.
+ * @return 0 on success
+ */
+static int mp3_follow_probes_enable_locked(void){
+	int ret;
+
+	if(follow_probes_registered) return 0;
+	if(!fork_tracepoint)
+		fork_tracepoint = (struct tracepoint *)kallsyms_lookup_name("__tracepoint_sched_process_fork");
+	if(!exit_tracepoint)
+		exit_tracepoint = (struct tracepoint *)kallsyms_lookup_name("__tracepoint_sched_process_exit");
+	if(!fork_tracepoint || !exit_tracepoint){
+		printk(KERN_ALERT "MP3 could not find the sched_process_fork and sched_process_exit tracepoints\n");
+		return -ENOSYS;
 	}
+	ret = tracepoint_probe_register(fork_tracepoint, (void *)mp3_fork_probe, NULL);
+	if(ret) return ret;
+	ret = tracepoint_probe_register(exit_tracepoint, (void *)mp3_exit_probe, NULL);
+	if(ret){
+		tracepoint_probe_unregister(fork_tracepoint, (void *)mp3_fork_probe, NULL);
+		tracepoint_synchronize_unregister();
+		return ret;
+	}
+	follow_probes_registered = true;
+	return 0;
+}
 
-	list_for_each_safe(pos, q, &head.task_node){
-		mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
-		//If task valid, update use. Otherwise, remove from list.
-		if(!get_cpu_use(tmp->pid, &tmp->minor_fault, &tmp->major_fault, &tmp->utime, &tmp->stime)){
-			total_major_fault += tmp->major_fault;
-			total_minor_fault += tmp->minor_fault;
-			total_utilization += (tmp->utime + tmp->stime);
-		} else {
-			printk(KERN_ALERT "Can not find CPU use for unknown PID: %u, deleting it\n", tmp->pid);
-			list_del(pos);
-			kfree(tmp);
-			num_entries--;
-		}
+/**
+ * @brief mp3_register_tree_locked - Registers a task, or with
+ * MP3_REGISTER_THREADS every thread of its thread group. The flags also make
+ * the probes register the threads the group creates later and, with
+ * MP3_REGISTER_CHILDREN, the processes it forks later. Only the shared
+ * session follows tasks, a private one registers the threads of the group
+ * once.
+ * Caller holds register_mutex.
+ * @param pid - the task
+ * @param flags - enum mp3_register_flags
+ * @param session - the session to register them in
+ * @return number of tasks registered, or a negative error
+ */
+static int mp3_register_tree_locked(pid_t pid, u32 flags, struct mp3_session *session){
+	struct task_struct *task;
+	pid_t tgid, *tids;
+	int i, n, ret, registered = 0;
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	tgid = task ? task_tgid_vnr(task) : 0;
+	rcu_read_unlock();
+	if(!tgid) return -ESRCH;
+
+	//follow first, so that threads created while the group is listed are not missed
+	if(session == &shared_session && (flags & (MP3_REGISTER_THREADS | MP3_REGISTER_CHILDREN))){
+		ret = mp3_follow_probes_enable_locked();
+		if(ret) return ret;
+		if(flags & MP3_REGISTER_THREADS) mp3_pid_table_insert(&follow_threads, tgid);
+		if(flags & MP3_REGISTER_CHILDREN) mp3_pid_table_insert(&follow_children, tgid);
 	}
-	mutex_unlock(&task_struct_mutex);
 
-	((unsigned long*)vbuffer)[vbuffer_idx++] = jiffies;
-	((unsigned long*)vbuffer)[vbuffer_idx++] = total_minor_fault;
-	((unsigned long*)vbuffer)[vbuffer_idx++] = total_major_fault;
-	((unsigned long*)vbuffer)[vbuffer_idx++] = total_utilization;
-	vbuffer_idx %= (VBUFFER_SIZE_B / sizeof(unsigned long));
+	if(!(flags & MP3_REGISTER_THREADS)){
+		ret = mp3_register_pid_locked(pid, session);
+		return ret == -EEXIST ? 0 : (ret ? ret : 1);
+	}
+	n = mp3_thread_ids(tgid, &tids);
+	if(n < 0) return n;
+	for(i = 0; i < n; i++){
+		if(!mp3_register_pid_locked(tids[i], session)) registered++;
+	}
+	kfree(tids);
+	return registered;
+}
 
-	printk(KERN_ALERT "vbuffer idx: %u max idx: %lu\n", vbuffer_idx, VBUFFER_SIZE_B / sizeof(unsigned long));
+/**
+ * @brief mp3_unregister_tree_locked - Unregisters a task, or with
+ * MP3_REGISTER_THREADS every registered thread of its thread group, and
+ * stops following them
+ * Caller holds register_mutex.
+ * @param pid - the task
+ * @param flags - enum mp3_register_flags
+ * @param session - the session they are registered in
+ * @return number of tasks unregistered
+ */
+static int mp3_unregister_tree_locked(pid_t pid, u32 flags, struct mp3_session *session){
+	mp3_task_struct *tmp;
+	struct task_struct *task;
+	pid_t tgid;
+	int n = 0;
+
+	if(!(flags & MP3_REGISTER_THREADS)){
+		tmp = mp3_remove_task(pid, false, session);
+		if(!tmp) return 0;
+		kfree(tmp);
+		return 1;
+	}
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	tgid = task ? task_tgid_vnr(task) : pid;
+	rcu_read_unlock();
+	while((tmp = mp3_remove_task(tgid, true, session))){
+		kfree(tmp);
+		n++;
+	}
+	return n;
+}
 
-	queue_delayed_work(queue, &mp3_deplayed_work, msecs_to_jiffies(50));
+/**
+ * @brief mp3_follow_work_func - Registers the children and threads and
+ * unregisters the exited tasks staged by the probes, in the order they
+ * happened
+ * @param work - unused
+ */
+static void mp3_follow_work_func(struct work_struct *work){
+	struct mp3_follow_event *event;
+	unsigned long dropped;
+	unsigned int i, n;
+
+	//the work is never run twice at once, so it owns follow_scratch
+	spin_lock(&follow_queue.lock);
+	n = follow_queue.n;
+	memcpy(follow_scratch, follow_queue.events, n * sizeof(struct mp3_follow_event));
+	follow_queue.n = 0;
+	dropped = follow_queue.dropped;
+	follow_queue.dropped = 0;
+	spin_unlock(&follow_queue.lock);
+
+	if(dropped) printk(KERN_ALERT "MP3 missed %lu forks and exits of followed tasks\n", dropped);
+
+	mutex_lock(&register_mutex);
+	for(i = 0; i < n; i++){
+		event = &follow_scratch[i];
+		if(event->exit) kfree(mp3_remove_task(event->pid, false, &shared_session));
+		else mp3_register_tree_locked(event->pid, event->flags, &shared_session);
+	}
+	mutex_unlock(&register_mutex);
 }
 
+/**
+ * @brief mp3_parse_flags - Parses the registration flags of the R and U commands
+ * @param s - the letters after the pid, 't' for MP3_REGISTER_THREADS and 'c'
+ * for MP3_REGISTER_CHILDREN
+ * @return enum mp3_register_flags
+ */
+static u32 mp3_parse_flags(const char *s){
+	u32 flags = 0;
+
+	for(; *s; s++){
+		if(*s == 't') flags |= MP3_REGISTER_THREADS;
+		else if(*s == 'c') flags |= MP3_REGISTER_CHILDREN;
+	}
+	return flags;
+}
 
 /**
  * @brief mp3_read - handler function for read. Called whenever a read is made
@@ -150,17 +1857,30 @@ static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, lo
 	ssize_t len;
 	struct list_head *pos;
 	unsigned offset = 0;
+	unsigned size;
+	int cpu;
 
 	//Copy to buffer if no previous data
-	if(num_entries && !*data){
-		kernelbuffer = (char*) kcalloc(100 * num_entries, sizeof(char), GFP_ATOMIC);
+	if(atomic_read(&num_entries) && !*data){
+		mutex_lock(&register_mutex);
+		size = 100 * (atomic_read(&num_entries) + 1);
+		kernelbuffer = (char*) kcalloc(size, sizeof(char), GFP_KERNEL);
+		if(!kernelbuffer){
+			mutex_unlock(&register_mutex);
+			return -ENOMEM;
+		}
 
-		mutex_lock(&task_struct_mutex);
-		list_for_each(pos, &head.task_node){
-			mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
-			offset += sprintf(kernelbuffer + offset, "PID:\t%u\n", tmp->pid);
+		//tasks that exit meanwhile only shrink the list
+		for_each_possible_cpu(cpu){
+			mutex_lock(&mp3_cpus[cpu].lock);
+			list_for_each(pos, &mp3_cpus[cpu].tasks){
+				mp3_task_struct * tmp = list_entry(pos, mp3_task_struct, task_node);
+				if(tmp->session != &shared_session) continue;
+				offset += snprintf(kernelbuffer + offset, size - offset, "PID:\t%u\n", tmp->pid);
+			}
+			mutex_unlock(&mp3_cpus[cpu].lock);
 		}
-		mutex_unlock(&task_struct_mutex);
+		mutex_unlock(&register_mutex);
 
 		len = min(strlen(kernelbuffer), count);
 		*data += len;
@@ -171,6 +1891,7 @@ static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, lo
 		}
 
 		if (copy_to_user(buffer, kernelbuffer, len)) {
+			kfree(kernelbuffer);
 			return -EFAULT;
 		}
 
@@ -190,9 +1911,9 @@ static ssize_t mp3_read(struct file *file, char __user *buffer, size_t count, lo
  */
 static ssize_t mp3_write(struct file *file, const char *buffer, size_t count, loff_t * data){
 	pid_t pid;
-	mp3_task_struct* tmp;
-
-	struct task_struct *toremove;
+	unsigned int interval, watermark, period;
+	char flag_letters[8];
+	int ret;
 
 	//calculate buffer size
 	if ( count > PROCFS_MAX_SIZE )	{
@@ -208,40 +1929,48 @@ static ssize_t mp3_write(struct file *file, const char *buffer, size_t count, lo
 	}
 
 	switch (procfs_buffer[0]) {
-		case 'R': //Registration
-			sscanf(&procfs_buffer[2], "%u", &pid);
+		case 'R': //Registration, followed by the flag letters
+			flag_letters[0] = '\0';
+			sscanf(&procfs_buffer[2], "%u %7s", &pid, flag_letters);
 			printk(KERN_ALERT "Registering task with PID:%u\n", pid);
-			tmp = (mp3_task_struct*)kmalloc(sizeof(mp3_task_struct), GFP_KERNEL);
-			tmp->linux_task = find_task_by_pid(pid);
-			tmp->major_fault = 0;
-			tmp->minor_fault = 0;
-			tmp->pid = pid;
-			tmp->utime = 0;
-			tmp->stime = 0;
-			INIT_LIST_HEAD(&tmp->task_node);
-
-			mutex_lock(&task_struct_mutex);
-			if(!num_entries) queue_delayed_work(queue, &mp3_deplayed_work, msecs_to_jiffies(50));
-			num_entries++;
-			list_add(&(tmp->task_node), &head.task_node);
-			mutex_unlock(&task_struct_mutex);
-			printk(KERN_ALERT "Registered task with PID:%u\n", tmp->pid);
+			mutex_lock(&register_mutex);
+			ret = mp3_register_tree_locked(pid, mp3_parse_flags(flag_letters), &shared_session);
+			mutex_unlock(&register_mutex);
+			if(ret < 0)
+				printk(KERN_ALERT "Could not register PID:%u\n", pid);
+			else
+				printk(KERN_ALERT "Registered %d tasks with PID:%u\n", ret, pid);
 			break;
-		case 'U': //Unregistration
-			sscanf(&procfs_buffer[2], "%u", &pid);
+		case 'U': //Unregistration, followed by the flag letters
+			flag_letters[0] = '\0';
+			sscanf(&procfs_buffer[2], "%u %7s", &pid, flag_letters);
 			printk(KERN_ALERT "Begin unregistering task with PID:%u\n", pid);
-			tmp = find_mp3_task_struct_by_pid(pid);
-			if(tmp){
-				toremove = tmp->linux_task;
-				mutex_lock(&task_struct_mutex);
-				num_entries--;
-				list_del(&(tmp->task_node));
-				kfree(tmp);
-				mutex_unlock(&task_struct_mutex);
-				printk(KERN_ALERT "Unregistered task with PID:%u\n", pid);
-			} else {
+			mutex_lock(&register_mutex);
+			ret = mp3_unregister_tree_locked(pid, mp3_parse_flags(flag_letters), &shared_session);
+			mutex_unlock(&register_mutex);
+			if(ret)
+				printk(KERN_ALERT "Unregistered %d tasks with PID:%u\n", ret, pid);
+			else
 				printk(KERN_ALERT "Received unknown PID in unregister: %u\n", pid);
-			}
+			break;
+		case 'I': //Sampling interval
+			sscanf(&procfs_buffer[2], "%u", &interval);
+			WRITE_ONCE(sample_interval_us, clamp_t(unsigned int, interval, MIN_SAMPLE_INTERVAL_US, MAX_SAMPLE_INTERVAL_US));
+			printk(KERN_ALERT "Sampling interval set to %uus\n", sample_interval_us);
+			break;
+		case 'W': //Wakeup watermark
+			sscanf(&procfs_buffer[2], "%u", &watermark);
+			WRITE_ONCE(wakeup_watermark, max(watermark, 1U));
+			printk(KERN_ALERT "Wakeup watermark set to %u samples\n", wakeup_watermark);
+			break;
+		case 'F': //Fault address sampling period
+			sscanf(&procfs_buffer[2], "%u", &period);
+			mutex_lock(&fault_mutex);
+			if(mp3_fault_sampling_set_locked(period))
+				printk(KERN_ALERT "Could not set the fault sampling period\n");
+			else
+				printk(KERN_ALERT "Sampling one in %u page faults\n", period);
+			mutex_unlock(&fault_mutex);
 			break;
 		default:
 			printk(KERN_ALERT "Received unknown prefix in mp3_write\n");
@@ -261,23 +1990,201 @@ static const struct file_operations mp3_file = {
 		.write = mp3_write
 };
 
+/**
+ * @brief mp3_session_init - Allocates the buffer of a session, a header page
+ * followed by one ring per cpu, and adds the session to the ones the timer
+ * samples
+ * @param s - the session, zeroed
+ * @param interval_us - its sampling interval
+ * @return 0 on success, -ENOMEM if the buffer could not be allocated
+ */
+static int mp3_session_init(struct mp3_session *s, unsigned int interval_us){
+	unsigned long x, flags;
+	int cpu;
+
+	s->total_b = PAGE_SIZE + nr_cpu_ids * (PAGE_SIZE + vbuffer_size_b);
+	s->vbuffer = vmalloc(s->total_b);
+	s->rings = kcalloc(nr_cpu_ids, sizeof(struct mp3_ring), GFP_KERNEL);
+	if(!s->vbuffer || !s->rings){
+		printk(KERN_ALERT "MP3 could not allocate a %lu byte buffer\n", s->total_b);
+		vfree(s->vbuffer);
+		kfree(s->rings);
+		return -ENOMEM;
+	}
+	memset(s->vbuffer, 0, s->total_b);
+	s->header = (struct mp3_buffer_header *)s->vbuffer;
+	s->header->magic = MP3_MAGIC;
+	s->header->version = MP3_VERSION;
+	s->header->data_offset = PAGE_SIZE;
+	s->header->data_size = vbuffer_size_b;
+	s->header->nr_rings = nr_cpu_ids;
+	s->header->ring_stride = PAGE_SIZE + vbuffer_size_b;
+	s->header->sample_interval_us = interval_us;
+	s->header->page_size = PAGE_SIZE;
+	s->header->hz = HZ;
+	s->header->mono_offset_ns = 0;
+	s->header->real_offset_ns = ktime_get_real_ns() - ktime_get_ns();
+
+	for(x = 0; x < s->total_b; x+=PAGE_SIZE){
+		SetPageReserved(vmalloc_to_page((void*)(s->vbuffer+x)));
+	}
+	for_each_possible_cpu(cpu){
+		s->rings[cpu].header = (struct mp3_ring_header *)(s->vbuffer + PAGE_SIZE + cpu * (PAGE_SIZE + vbuffer_size_b));
+		s->rings[cpu].data = (uint8_t *)s->rings[cpu].header + PAGE_SIZE;
+		s->rings[cpu].session = s;
+		//pipe buffers only know their page, which leads back to the ring
+		for(x = 0; x < vbuffer_size_b; x+=PAGE_SIZE)
+			set_page_private(vmalloc_to_page(s->rings[cpu].data + x), (unsigned long)&s->rings[cpu]);
+	}
+
+	s->interval_us = interval_us;
+	atomic_set(&s->num_entries, 0);
+	init_waitqueue_head(&s->wait);
+	mutex_init(&s->read_mutex);
+	kref_init(&s->ref);
+	spin_lock_irqsave(&session_lock, flags);
+	list_add_tail(&s->node, &sessions);
+	spin_unlock_irqrestore(&session_lock, flags);
+	return 0;
+}
+
+/**
+ * @brief mp3_session_free - Frees the buffer of a session once the file and
+ * every pipe buffer that maps its rings are gone
+ * @param ref - the reference count of the session
+ */
+static void mp3_session_free(struct kref *ref){
+	struct mp3_session *s = container_of(ref, struct mp3_session, ref);
+	unsigned long x;
+
+	for(x = 0; x < s->total_b; x+=PAGE_SIZE){
+		set_page_private(vmalloc_to_page((void*)(s->vbuffer+x)), 0);
+		ClearPageReserved(vmalloc_to_page((void*)(s->vbuffer+x)));
+	}
+	vfree(s->vbuffer);
+	kfree(s->rings);
+	mutex_destroy(&s->read_mutex);
+	if(s != &shared_session) kfree(s);
+}
+
+/**
+ * @brief mp3_session_exit - Stops sampling a session, unregisters its tasks
+ * and drops the reference of its file, which frees its buffer unless a pipe
+ * still holds some of its records
+ * @param s - the session
+ */
+static void mp3_session_exit(struct mp3_session *s){
+	struct list_head *pos, *q;
+	mp3_task_struct *tmp;
+	unsigned long flags;
+	int cpu;
+
+	//no round samples the session after this, and removing its tasks under
+	//the lock of each cpu waits for a work still writing into its rings
+	spin_lock_irqsave(&session_lock, flags);
+	list_del(&s->node);
+	spin_unlock_irqrestore(&session_lock, flags);
+
+	mutex_lock(&register_mutex);
+	for_each_possible_cpu(cpu){
+		mutex_lock(&mp3_cpus[cpu].lock);
+		list_for_each_safe(pos, q, &mp3_cpus[cpu].tasks){
+			tmp = list_entry(pos, mp3_task_struct, task_node);
+			if(tmp->session != s) continue;
+			//never leave a task stopped behind
+			if(tmp->suspended){
+				mp3_signal_task(tmp->tgid, SIGCONT);
+				atomic_dec(&thrash_suspended);
+			}
+			list_del(pos);
+			mp3_cpus[cpu].num_entries--;
+			atomic_dec(&num_entries);
+			atomic_dec(&s->num_entries);
+			kfree(tmp);
+		}
+		mutex_unlock(&mp3_cpus[cpu].lock);
+	}
+	mutex_unlock(&register_mutex);
+
+	kref_put(&s->ref, mp3_session_free);
+}
+
+/**
+ * @brief chardev_open - Opens the shared session on minor 0, and creates a
+ * private session with its own tasks, buffer and interval on every open of
+ * minor 1
+ * @param inode - the device
+ * @param filp - the file, which keeps the session
+ * @return 0 on success, -EBUSY if MAX_SESSIONS private sessions are open
+ */
+static int chardev_open(struct inode *inode, struct file *filp)
+{
+	struct mp3_session *s;
+	unsigned long flags;
+	int ret = 0;
+
+	if(iminor(inode) == MP3_MINOR_SHARED){
+		filp->private_data = &shared_session;
+		return 0;
+	}
+
+	spin_lock_irqsave(&session_lock, flags);
+	if(num_sessions < MAX_SESSIONS) num_sessions++;
+	else ret = -EBUSY;
+	spin_unlock_irqrestore(&session_lock, flags);
+	if(ret) return ret;
+
+	s = kzalloc(sizeof(struct mp3_session), GFP_KERNEL);
+	ret = s ? mp3_session_init(s, mp3_sample_interval()) : -ENOMEM;
+	if(ret){
+		kfree(s);
+		spin_lock_irqsave(&session_lock, flags);
+		num_sessions--;
+		spin_unlock_irqrestore(&session_lock, flags);
+		return ret;
+	}
+	filp->private_data = s;
+	return 0;
+}
+
+/**
+ * @brief chardev_release - Ends the private session of a file once it is
+ * closed and no longer mapped
+ * @param inode - the device
+ * @param filp - the file
+ * @return 0
+ */
+static int chardev_release(struct inode *inode, struct file *filp)
+{
+	struct mp3_session *s = filp->private_data;
+	unsigned long flags;
+
+	if(s == &shared_session) return 0;
+	mp3_session_exit(s);
+	spin_lock_irqsave(&session_lock, flags);
+	num_sessions--;
+	spin_unlock_irqrestore(&session_lock, flags);
+	return 0;
+}
+
 /**
  * @brief chardev_mmap - This function is called whenever a user space application
- * wants to use shared memory pages
+ * wants to use shared memory pages. Maps the buffer of the session of the file.
  * @param filp - input file
  * @param vma - virtual memory struct
  * @return  0 on success
  */
 static int chardev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	struct mp3_session *s = filp->private_data;
 	unsigned long x;
 	unsigned long pfn;
 	unsigned long size = vma->vm_end - vma->vm_start;
 
-	if(size > VBUFFER_SIZE_B) return -EINVAL;
+	if(size > s->total_b) return -EINVAL;
 
 	for(x = 0; x < size; x+=PAGE_SIZE){
-		pfn = vmalloc_to_pfn((void*)(vbuffer+x));
+		pfn = vmalloc_to_pfn((void*)(s->vbuffer+x));
 		if(remap_pfn_range(vma, vma->vm_start+x, pfn, PAGE_SIZE, vma->vm_page_prot)){
 			printk(KERN_ALERT "MP3 module could not perform mmap!\n");
 			return -EAGAIN;
@@ -287,13 +2194,391 @@ static int chardev_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
+/**
+ * @brief mp3_ring_peek - The next unread record of a ring for chardev_read,
+ * skipping pad records. Caller holds the read_mutex of the session.
+ * @param c - the ring
+ * @return the record, NULL if the ring has no more records
+ */
+static struct mp3_record_header *mp3_ring_peek(struct mp3_ring *c){
+	struct mp3_record_header *record;
+
+	while(c->read_pos != c->read_end){
+		record = (struct mp3_record_header *)(c->data + (c->read_pos & (vbuffer_size_b - 1)));
+		//the ring is mapped writable, so a corrupt record drops the rest
+		//pad records can be shorter than a record header
+		if(record->size < MP3_RECORD_ALIGN || record->size > vbuffer_size_b){
+			c->read_pos = c->read_end;
+			break;
+		}
+		if(record->type != MP3_RECORD_PAD) return record;
+		c->read_pos += record->size;
+	}
+	return NULL;
+}
+
+/**
+ * @brief chardev_read - Copies whole unread records out of the rings of the
+ * session of the file and consumes them, merging the rings by time_ns. Blocks until the watermark is
+ * reached unless the file is non blocking. Use either read or a mmap
+ * consumer, not both at once.
+ * @param filp - input file
+ * @param buffer - userspace buffer to copy the records to
+ * @param count - size of buffer
+ * @param offset - unused, the ring has no file position
+ * @return number of bytes read
+ */
+static ssize_t chardev_read(struct file *filp, char __user *buffer, size_t count, loff_t *offset)
+{
+	struct mp3_session *s = filp->private_data;
+	struct mp3_record_header *record, *next;
+	struct mp3_ring *c, *next_cpu;
+	size_t copied = 0;
+	ssize_t ret = 0;
+	int cpu;
+
+	if(!mp3_ring_readable(s)){
+		if(filp->f_flags & O_NONBLOCK) return -EAGAIN;
+		if(wait_event_interruptible(s->wait, mp3_ring_readable(s))) return -ERESTARTSYS;
+	}
+
+	mutex_lock(&s->read_mutex);
+	for_each_possible_cpu(cpu){
+		c = &s->rings[cpu];
+		c->read_end = smp_load_acquire(&c->header->producer);
+		c->read_pos = READ_ONCE(c->header->consumer);
+		if(c->read_end - c->read_pos > vbuffer_size_b) c->read_pos = c->read_end - vbuffer_size_b;
+	}
+
+	while(1){
+		//the oldest record at the head of any ring, ties go to the lower cpu
+		next = NULL;
+		next_cpu = NULL;
+		for_each_possible_cpu(cpu){
+			c = &s->rings[cpu];
+			record = mp3_ring_peek(c);
+			if(record && (!next || record->time_ns < next->time_ns)){
+				next = record;
+				next_cpu = c;
+			}
+		}
+		if(!next) break;
+		if(copied + next->size > count){
+			//a buffer too small for a single record would look like end of file
+			if(!copied) ret = -EINVAL;
+			break;
+		}
+		if(copy_to_user(buffer + copied, next, next->size)){
+			ret = -EFAULT;
+			break;
+		}
+		copied += next->size;
+		next_cpu->read_pos += next->size;
+	}
+
+	for_each_possible_cpu(cpu)
+		smp_store_release(&s->rings[cpu].header->consumer, s->rings[cpu].read_pos);
+	mutex_unlock(&s->read_mutex);
+
+	return copied ? copied : ret;
+}
+
+/**
+ * @brief mp3_splice_start - Where chardev_splice_read continues in a ring:
+ * behind the records already handed to a pipe, unless read or a mmap
+ * consumer moved the consumer past them
+ * @param r - the ring
+ * @param consumer - the consumer of the ring
+ * @return the ring position
+ */
+static u64 mp3_splice_start(struct mp3_ring *r, u64 consumer){
+	return r->splice_pos - consumer <= vbuffer_size_b ? r->splice_pos : consumer;
+}
+
+/**
+ * @brief mp3_splice_readable - Checks if the records of a session that were
+ * not handed to a pipe yet reached the watermark
+ * @param s - the session
+ * @return true if chardev_splice_read has records to hand over
+ */
+static bool mp3_splice_readable(struct mp3_session *s){
+	u64 watermark = (u64)max(READ_ONCE(wakeup_watermark), 1U) * sizeof(struct mp3_task_record);
+	struct mp3_ring *r;
+	u64 consumer, unspliced = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		r = &s->rings[cpu];
+		consumer = READ_ONCE(r->header->consumer);
+		unspliced += min_t(u64, smp_load_acquire(&r->header->producer) - mp3_splice_start(r, consumer), vbuffer_size_b);
+	}
+	return unspliced >= min_t(u64, watermark, vbuffer_size_b);
+}
+
+/**
+ * @brief mp3_pipe_buf_release - Consumes the records of a pipe buffer once
+ * the pipe is done with them, which lets the sampler reuse their space, and
+ * drops the reference the buffer holds on the session
+ * @param pipe - the pipe
+ * @param buf - the buffer, whose private field is the ring position its
+ * records end at
+ */
+static void mp3_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf){
+	struct mp3_ring *r = (struct mp3_ring *)page_private(buf->page);
+	u64 consumer = READ_ONCE(r->header->consumer);
+	//the low bits of the end are enough as it is at most a ring ahead, and a
+	//tee of the buffer released later finds the consumer past it already
+	u32 ahead = (u32)buf->private - (u32)consumer;
+
+	if(ahead && ahead <= vbuffer_size_b) smp_store_release(&r->header->consumer, consumer + ahead);
+	kref_put(&r->session->ref, mp3_session_free);
+	module_put(THIS_MODULE);
+}
+
+/**
+ * @brief mp3_pipe_buf_get - Takes another reference on the session for a
+ * copy of a pipe buffer made by tee
+ * @param pipe - the pipe
+ * @param buf - the buffer
+ */
+static void mp3_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf){
+	struct mp3_ring *r = (struct mp3_ring *)page_private(buf->page);
+
+	kref_get(&r->session->ref);
+	__module_get(THIS_MODULE);
+}
+
+/**
+ * @brief mp3_pipe_buf_steal - Refuses to give a ring page away, since the
+ * sampler writes to it again on the next lap
+ * @param pipe - the pipe
+ * @param buf - the buffer
+ * @return 1, the page can not be stolen
+ */
+static int mp3_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf){
+	return 1;
+}
+
+/**
+ * @brief operations of the pipe buffers that point at the pages of the rings
+ */
+static const struct pipe_buf_operations mp3_pipe_buf_ops = {
+		.can_merge = 0,
+		.confirm = generic_pipe_buf_confirm,
+		.release = mp3_pipe_buf_release,
+		.steal = mp3_pipe_buf_steal,
+		.get = mp3_pipe_buf_get
+};
+
+/**
+ * @brief the pages of one chardev_splice_read
+ */
+struct mp3_splice {
+	struct splice_pipe_desc spd;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct mp3_session *session;
+	bool cut;
+};
+
+/**
+ * @brief mp3_splice_spd_release - Takes back a page splice_to_pipe could not
+ * add to the pipe. Those are always the last pages, so the ring of the first
+ * one stopped in the middle of its records and goes first next time.
+ * @param spd - the splice
+ * @param i - the page
+ */
+static void mp3_splice_spd_release(struct splice_pipe_desc *spd, unsigned int i){
+	struct mp3_splice *sp = container_of(spd, struct mp3_splice, spd);
+	struct mp3_ring *r = (struct mp3_ring *)page_private(spd->pages[i]);
+
+	if(!sp->cut){
+		sp->cut = true;
+		sp->session->splice_ring = r - sp->session->rings;
+	}
+	r->splice_pos -= spd->partial[i].len;
+	kref_put(&r->session->ref, mp3_session_free);
+	module_put(THIS_MODULE);
+}
+
+/**
+ * @brief mp3_splice_fill - Adds the whole records of a ring that were not
+ * handed to a pipe yet to a splice, one pipe buffer per page, as many as fit
+ * in len bytes and the pipe buffers left. Caller holds the read_mutex of the
+ * session.
+ * @param sp - the splice
+ * @param r - the ring
+ * @param len - the most bytes to add
+ * @return number of bytes added
+ */
+static size_t mp3_splice_fill(struct mp3_splice *sp, struct mp3_ring *r, size_t len){
+	u64 consumer = READ_ONCE(r->header->consumer);
+	u64 producer = smp_load_acquire(&r->header->producer);
+	struct mp3_record_header *record;
+	u64 start, pos, end;
+	size_t budget;
+	u32 offset, n;
+	int i;
+
+	//b bytes span at most b / PAGE_SIZE + 2 pages, even across the end of the ring
+	if(producer - consumer > vbuffer_size_b || sp->spd.nr_pages + 3 > PIPE_DEF_BUFFERS) return 0;
+	budget = min_t(size_t, len, (PIPE_DEF_BUFFERS - sp->spd.nr_pages - 2) * PAGE_SIZE);
+	start = mp3_splice_start(r, consumer);
+	for(end = start; end != producer; end += record->size){
+		record = (struct mp3_record_header *)(r->data + (end & (vbuffer_size_b - 1)));
+		//the ring is mapped writable, so a corrupt record ends the splice of the ring
+		if(record->size < MP3_RECORD_ALIGN || record->size > producer - end) break;
+		if(end + record->size - start > budget) break;
+	}
+
+	//a page holds whole records or parts of them, never the end and the start of the ring
+	for(pos = start; pos != end; pos += n){
+		offset = pos & (vbuffer_size_b - 1);
+		n = min_t(u64, end - pos, PAGE_SIZE - (offset & ~PAGE_MASK));
+		i = sp->spd.nr_pages++;
+		sp->pages[i] = vmalloc_to_page(r->data + offset);
+		sp->partial[i].offset = offset & ~PAGE_MASK;
+		sp->partial[i].len = n;
+		sp->partial[i].private = (unsigned long)(pos + n);
+		kref_get(&r->session->ref);
+		__module_get(THIS_MODULE);
+	}
+	r->splice_pos = end;
+	return end - start;
+}
+
+/**
+ * @brief chardev_splice_read - Hands the unread records of the session of
+ * the file to a pipe without copying them, for splice and sendfile. The pipe
+ * buffers point at the pages of the rings, and their records are consumed
+ * when the pipe releases them, so the sampler does not overwrite them while
+ * they are in the pipe. The rings are taken in turns, each with whole records
+ * in ring order, and are not merged by time. Blocks until the watermark is
+ * reached unless the file or the splice is non blocking. Use either splice,
+ * read or a mmap consumer, not several at once.
+ * @param in - input file
+ * @param ppos - unused, the ring has no file position
+ * @param pipe - the pipe
+ * @param len - the most bytes to hand over
+ * @param flags - splice flags
+ * @return number of bytes handed to the pipe
+ */
+static ssize_t chardev_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct mp3_session *s = in->private_data;
+	struct mp3_splice sp;
+	size_t added = 0;
+	ssize_t ret;
+	int i, cpu;
+
+	if(!mp3_splice_readable(s)){
+		if((in->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK)) return -EAGAIN;
+		if(wait_event_interruptible(s->wait, mp3_splice_readable(s))) return -ERESTARTSYS;
+	}
+
+	memset(&sp, 0, sizeof(sp));
+	sp.spd.pages = sp.pages;
+	sp.spd.partial = sp.partial;
+	sp.spd.nr_pages_max = PIPE_DEF_BUFFERS;
+	sp.spd.flags = flags;
+	sp.spd.ops = &mp3_pipe_buf_ops;
+	sp.spd.spd_release = mp3_splice_spd_release;
+	sp.session = s;
+
+	mutex_lock(&s->read_mutex);
+	cpu = s->splice_ring;
+	for(i = 0; i < nr_cpu_ids; i++){
+		if(cpu_possible(cpu)) added += mp3_splice_fill(&sp, &s->rings[cpu], len - added);
+		cpu = (cpu + 1) % nr_cpu_ids;
+	}
+	if(!sp.spd.nr_pages){
+		mutex_unlock(&s->read_mutex);
+		//a length too small for a single record would look like end of file
+		return -EINVAL;
+	}
+	//start with the next ring next time, unless a ring is cut short
+	s->splice_ring = (s->splice_ring + 1) % nr_cpu_ids;
+	ret = splice_to_pipe(pipe, &sp.spd);
+	mutex_unlock(&s->read_mutex);
+	return ret;
+}
+
+/**
+ * @brief chardev_poll - Reports the device readable once the number of unread
+ * samples of the session of the file reaches the watermark
+ * @param filp - input file
+ * @param wait - poll table
+ * @return POLLIN | POLLRDNORM when readable
+ */
+static unsigned int chardev_poll(struct file *filp, poll_table *wait)
+{
+	struct mp3_session *s = filp->private_data;
+
+	poll_wait(filp, &s->wait, wait);
+	return mp3_ring_readable(s) ? POLLIN | POLLRDNORM : 0;
+}
+
+/**
+ * @brief chardev_ioctl - Registers or unregisters a batch of tasks in one
+ * call, so a multiprocess service needs no write per task, or sets the
+ * sampling interval. Both apply to the session of the file.
+ * @param filp - input file
+ * @param cmd - MP3_IOC_REGISTER, MP3_IOC_UNREGISTER or MP3_IOC_INTERVAL
+ * @param arg - user pointer to a struct mp3_register, or to the interval in
+ * microseconds
+ * @return number of tasks registered or unregistered, or a negative error
+ */
+static long chardev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mp3_session *s = filp->private_data;
+	struct mp3_register reg;
+	u32 interval;
+	s32 *pids;
+	long done = 0;
+	u32 i;
+	int ret;
+
+	if(cmd == MP3_IOC_INTERVAL){
+		if(get_user(interval, (u32 __user *)arg)) return -EFAULT;
+		interval = clamp_t(u32, interval, MIN_SAMPLE_INTERVAL_US, MAX_SAMPLE_INTERVAL_US);
+		if(s == &shared_session) WRITE_ONCE(sample_interval_us, interval);
+		else WRITE_ONCE(s->interval_us, interval);
+		return 0;
+	}
+	if(cmd != MP3_IOC_REGISTER && cmd != MP3_IOC_UNREGISTER) return -ENOTTY;
+	if(copy_from_user(&reg, (void __user *)arg, sizeof(reg))) return -EFAULT;
+	if(!reg.count || reg.count > MP3_REGISTER_MAX || reg.flags & ~(MP3_REGISTER_THREADS | MP3_REGISTER_CHILDREN))
+		return -EINVAL;
+	//only the shared session follows forks
+	if(s != &shared_session && (reg.flags & MP3_REGISTER_CHILDREN)) return -EINVAL;
+	pids = memdup_user((void __user *)(uintptr_t)reg.pids, reg.count * sizeof(s32));
+	if(IS_ERR(pids)) return PTR_ERR(pids);
+
+	mutex_lock(&register_mutex);
+	for(i = 0; i < reg.count; i++){
+		if(cmd == MP3_IOC_REGISTER) ret = mp3_register_tree_locked(pids[i], reg.flags, s);
+		else ret = mp3_unregister_tree_locked(pids[i], reg.flags, s);
+		if(ret > 0) done += ret;
+	}
+	mutex_unlock(&register_mutex);
+
+	kfree(pids);
+	return done;
+}
+
 /**
  * @brief character device driver file operations
  */
 static const struct file_operations mp3_chardev_fops = {
 		.owner = THIS_MODULE,
-		.open = NULL,
-		.release = NULL,
+		.open = chardev_open,
+		.release = chardev_release,
+		.read = chardev_read,
+		.splice_read = chardev_splice_read,
+		.poll = chardev_poll,
+		.unlocked_ioctl = chardev_ioctl,
+		.compat_ioctl = chardev_ioctl,
+		.llseek = no_llseek,
 		.mmap = chardev_mmap
 };
 
@@ -303,40 +2588,71 @@ static const struct file_operations mp3_chardev_fops = {
  */
 int __init mp3_init(void)
 {
-	unsigned long x;
+	struct mp3_cpu *c;
+	int cpu;
 #ifdef DEBUG
 	printk(KERN_ALERT "MP3 MODULE LOADING\n");
 #endif
 
-	//create proc files
-	proc_dir = proc_mkdir("mp3", NULL);
-	proc_entry = proc_create("status", 0666, proc_dir, &mp3_file);
-
-	//create vbuffer
-	vbuffer = vmalloc(VBUFFER_SIZE_B);
-	memset(vbuffer, -1, VBUFFER_SIZE_B);
-	vbuffer_idx = 0;
-
-	for(x = 0; x < VBUFFER_SIZE_B; x+=PAGE_SIZE){
-		SetPageReserved(vmalloc_to_page((void*)(vbuffer+x)));
+	//create the buffer of the shared session, a header page followed by one ring per cpu
+	vbuffer_size_b = roundup_pow_of_two(max(buffer_pages, 1U)) * PAGE_SIZE;
+	mp3_cpus = vzalloc(nr_cpu_ids * sizeof(struct mp3_cpu));
+	if(!mp3_cpus) return -ENOMEM;
+	if(mp3_session_init(&shared_session, mp3_sample_interval())){
+		vfree(mp3_cpus);
+		return -ENOMEM;
 	}
 
-	//create a mutex
-	mutex_init(&task_struct_mutex);
+	//init the sampler of every cpu
+	for_each_possible_cpu(cpu){
+		c = &mp3_cpus[cpu];
+		c->cpu = cpu;
+		mutex_init(&c->lock);
+		INIT_LIST_HEAD(&c->tasks);
+		INIT_WORK(&c->work, mp3_work_func);
+		spin_lock_init(&c->stage.lock);
+	}
+	INIT_WORK(&follow_work, mp3_follow_work_func);
 
 	//init character device driver
-	alloc_chrdev_region(&mp3_dev, 0, 1, "mp3_cdev");
+	alloc_chrdev_region(&mp3_dev, 0, MP3_MINORS, "mp3_cdev");
 	cdev_init(&mp3_cdev, &mp3_chardev_fops);
-	cdev_add(&mp3_cdev, mp3_dev, 1);
-
-	//init list
-	num_entries = 0;
-	INIT_LIST_HEAD(&head.task_node);
+	cdev_add(&mp3_cdev, mp3_dev, MP3_MINORS);
 
 //	printk(KERN_ALERT "Page size is %lu\n", PAGE_SIZE);
 
-	//create workqueue and timer
-	queue = create_singlethread_workqueue("mp3_workqueue");
+	//create workqueue and timer, the work of every cpu runs on that cpu
+	queue = alloc_workqueue("mp3_workqueue", 0, 0);
+	hrtimer_init(&sample_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sample_timer.function = sample_timer_callback;
+
+	//look up the accessed bit helpers of the working set estimate
+	mp3_ptep_clear_flush_young = (void *)kallsyms_lookup_name("ptep_clear_flush_young");
+	mp3_mmu_notifier_clear_flush_young = (void *)kallsyms_lookup_name("__mmu_notifier_clear_flush_young");
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	mp3_pmdp_clear_flush_young = (void *)kallsyms_lookup_name("pmdp_clear_flush_young");
+	wss_available = mp3_pmdp_clear_flush_young != NULL;
+#else
+	wss_available = true;
+#endif
+	wss_available = wss_available && mp3_ptep_clear_flush_young;
+#ifdef CONFIG_MMU_NOTIFIER
+	wss_available = wss_available && mp3_mmu_notifier_clear_flush_young;
+#endif
+	if(!wss_available)
+		printk(KERN_ALERT "MP3 could not find the accessed bit helpers, working set sampling is disabled\n");
+
+	//start fault sampling if requested at load time
+	if(fault_sample_period){
+		mutex_lock(&fault_mutex);
+		if(mp3_fault_sampling_set_locked(fault_sample_period))
+			fault_sample_period = 0;
+		mutex_unlock(&fault_mutex);
+	}
+
+	//create proc files last, they register tasks with the samplers
+	proc_dir = proc_mkdir("mp3", NULL);
+	proc_entry = proc_create("status", 0666, proc_dir, &mp3_file);
 
 	printk(KERN_ALERT "MP3 MODULE LOADED\n");
 	return 0;
@@ -347,9 +2663,7 @@ int __init mp3_init(void)
  */
 void __exit mp3_exit(void)
 {
-	struct list_head *pos, *q;
-	mp3_task_struct* tmp;
-	unsigned long x = 0;
+	int cpu;
 #ifdef DEBUG
 	printk(KERN_ALERT "MP3 MODULE UNLOADING\n");
 #endif
@@ -359,30 +2673,30 @@ void __exit mp3_exit(void)
 	proc_remove(proc_dir);
 
 	//cleanup
-	cancel_delayed_work_sync(&mp3_deplayed_work);
-	flush_delayed_work(&mp3_deplayed_work);
-	destroy_workqueue(queue);
-
-	//cleanup task list
-	mutex_lock(&task_struct_mutex);
-	list_for_each_safe(pos, q, &head.task_node){
-		tmp = list_entry(pos, mp3_task_struct, task_node);
-		list_del(pos);
-		kfree(tmp);
+	mutex_lock(&fault_mutex);
+	mp3_fault_sampling_set_locked(0);
+	mutex_unlock(&fault_mutex);
+	if(follow_probes_registered){
+		tracepoint_probe_unregister(fork_tracepoint, (void *)mp3_fork_probe, NULL);
+		tracepoint_probe_unregister(exit_tracepoint, (void *)mp3_exit_probe, NULL);
+		tracepoint_synchronize_unregister();
 	}
-	mutex_unlock(&task_struct_mutex);
+	cancel_work_sync(&follow_work);
+	hrtimer_cancel(&sample_timer);
+	for_each_possible_cpu(cpu)
+		cancel_work_sync(&mp3_cpus[cpu].work);
+	destroy_workqueue(queue);
 
-	mutex_destroy(&task_struct_mutex);
+	//cleanup task lists and the buffer, open files keep the module loaded so
+	//the shared session is the last one
+	mp3_session_exit(&shared_session);
+	for_each_possible_cpu(cpu)
+		mutex_destroy(&mp3_cpus[cpu].lock);
+	vfree(mp3_cpus);
 
 	//remove character device driver
 	cdev_del(&mp3_cdev);
-	unregister_chrdev_region(mp3_dev, 1);
-
-	//remove memory buffer
-	for(x = 0; x < VBUFFER_SIZE_B; x+=PAGE_SIZE){
-		ClearPageReserved(vmalloc_to_page((void*)(vbuffer+x)));
-	}
-	vfree(vbuffer);
+	unregister_chrdev_region(mp3_dev, MP3_MINORS);
 
 	printk(KERN_ALERT "MP3 MODULE UNLOADED\n");
 }
@@ -17,7 +17,8 @@ struct task_struct* find_task_by_pid(unsigned int nr)
 
 // THIS FUNCTION RETURNS 0 IF THE PID IS VALID. IT ALSO RETURNS THE
 // PROCESS CPU TIME IN JIFFIES AND MAJOR AND MINOR PAGE FAULT COUNTS
-// SINCE THE LAST INVOCATION OF THE FUNCTION FOR THE SPECIFIED PID.
+// SINCE THE PROCESS STARTED. THE COUNTERS OF THE TASK ARE LEFT UNTOUCHED,
+// SO CALLERS KEEP THE PREVIOUS VALUES AND TAKE THE DIFFERENCE.
 // OTHERWISE IT RETURNS -1
 int get_cpu_use(int pid, unsigned long *min_flt, unsigned long *maj_flt,
          unsigned long *utime, unsigned long *stime)
@@ -31,11 +32,6 @@ int get_cpu_use(int pid, unsigned long *min_flt, unsigned long *maj_flt,
                 *maj_flt=task->maj_flt;
                 *utime=task->utime;
                 *stime=task->stime;
-
-                task->maj_flt = 0;
-                task->min_flt = 0;
-                task->utime = 0;
-                task->stime = 0;
                 ret = 0;
         }
         rcu_read_unlock();
@@ -0,0 +1,231 @@
+#ifndef __MP3_SHARED_INCLUDE__
+#define __MP3_SHARED_INCLUDE__
+
+/*
+ * Definitions shared by the MP3 kernel module and the userspace tools that read
+ * the profiler buffer.
+ *
+ * The buffer starts with a header page followed by nr_rings rings, one per
+ * cpu, each ring_stride bytes apart from data_offset on. A ring is a ring
+ * header page followed by data_size bytes of variable sized records. The
+ * sampler of the cpu is the only producer of its ring and advances producer,
+ * the reader is the only consumer and advances consumer. Both are free running
+ * byte counts; a record starts at (counter & (data_size - 1)) in the ring.
+ * Records never wrap around the end of the ring, the space left at the end is
+ * filled with a MP3_RECORD_PAD record instead. When the ring is full, new
+ * records are dropped and counted in overrun. Records of one ring are in time
+ * order, readers merge the rings by time_ns.
+ *
+ * The record header is versioned, the record bodies are not. The header
+ * changes only with MP3_VERSION: version 7 added time_ns and jitter_ns after
+ * jiffies, and the header of older modules is MP3_RECORD_HEADER_V6_SIZE bytes
+ * long. Readers check the version of the buffer (or of the stream) first and
+ * find the body of a record behind the header of that version. The body of a
+ * record type only ever grows at the end: a field added to it goes after all
+ * existing ones, and readers take its length from hdr.size, so they decode
+ * records written by older modules (the missing fields read as zero) and
+ * ignore the fields added by newer ones. Task records also say which of their
+ * counters are valid in fields.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MP3_MAGIC 0x4d503342 /* "MP3B" */
+#define MP3_VERSION 7
+
+/* records are padded to this size so a pad record always fits */
+#define MP3_RECORD_ALIGN 16
+
+/* pid of the record that sums all registered tasks */
+#define MP3_AGGREGATE_PID 0
+
+/* number of equal buckets every VMA of a fault heat record is divided into */
+#define MP3_HEAT_BUCKETS 32
+
+/**
+ * @brief the header page of the profiler buffer
+ */
+struct mp3_buffer_header {
+	__u32 magic;
+	__u32 version;
+	__u32 data_offset; /* offset of the first ring from the start of the buffer */
+	__u32 data_size;   /* size of the records of each ring in bytes, a power of two */
+	__u32 nr_rings;    /* number of rings, one per possible cpu */
+	__u32 ring_stride; /* distance between two rings, page_size + data_size */
+	__u32 sample_interval_us; /* current sampling interval */
+	__u32 page_size;   /* size of the ring header, the records follow it */
+	/* since version 7 */
+	__u32 hz;          /* jiffies per second */
+	__u32 pad;
+	__s64 mono_offset_ns; /* CLOCK_MONOTONIC - time_ns of the records, 0 as time_ns is CLOCK_MONOTONIC */
+	__s64 real_offset_ns; /* CLOCK_REALTIME - time_ns of the records, updated every sample */
+};
+
+/**
+ * @brief the header page of one ring
+ */
+struct mp3_ring_header {
+	__u64 seq;           /* number of records produced, including dropped ones */
+	__u64 overrun;       /* number of records dropped because the ring was full */
+	__u64 fault_samples; /* fault addresses sampled into heat records */
+	__u64 fault_overrun; /* fault addresses dropped before they were aggregated */
+
+	/* written by the kernel only, read with acquire semantics */
+	__u64 producer __attribute__((aligned(64)));
+	/* written by the reader only, written with release semantics */
+	__u64 consumer __attribute__((aligned(64)));
+};
+
+/**
+ * @brief the record types
+ */
+enum mp3_record_type {
+	MP3_RECORD_PAD = 0,       /* skip to the start of the ring */
+	MP3_RECORD_TASK = 1,      /* struct mp3_task_record of one task */
+	MP3_RECORD_AGGREGATE = 2, /* struct mp3_task_record summing all tasks */
+	MP3_RECORD_HEAT = 3,      /* struct mp3_heat_record of one VMA of one task */
+	MP3_RECORD_CONTROL = 4,   /* struct mp3_control_record of one thrashing control decision */
+};
+
+/**
+ * @brief the header every record starts with
+ */
+struct mp3_record_header {
+	__u16 type;
+	__u16 size; /* size of the whole record in bytes */
+	__u32 pid;
+	__u64 jiffies;
+	/* since version 7 */
+	__u64 time_ns;   /* CLOCK_MONOTONIC time the record was sampled at */
+	__s64 jitter_ns; /* time_ns minus the time the sample was due */
+};
+
+/* size of the record header of version 6 and older modules, which ends with jiffies */
+#define MP3_RECORD_HEADER_V6_SIZE 16
+
+/**
+ * @brief the counters of a task record that were sampled, in fields
+ */
+enum mp3_task_field {
+	MP3_FIELD_WSS = 1 << 0,        /* wss_pages */
+	MP3_FIELD_RSS = 1 << 1,        /* rss_pages */
+	MP3_FIELD_SWAP = 1 << 2,       /* swap_pages */
+	MP3_FIELD_THP = 1 << 3,        /* thp_pages */
+	MP3_FIELD_NUMA = 1 << 4,       /* numa_local and numa_remote */
+	MP3_FIELD_THP_FAULTS = 1 << 5, /* thp_faults and thp_fallbacks */
+};
+
+
+/**
+ * @brief one sample of one registered task, or of all of them. The counters
+ * after min_flt, maj_flt and cpu_time are only valid if their bit is set in
+ * fields. The page counts are those at the time of the sample, the faults
+ * and cpu time those of the interval.
+ */
+struct mp3_task_record {
+	struct mp3_record_header hdr;
+	__u64 min_flt;
+	__u64 maj_flt;
+	__u64 cpu_time; /* utime + stime */
+	__u64 wss_pages; /* pages accessed since the previous sample, 0 if not estimated */
+	/* since version 6 */
+	__u64 fields;        /* enum mp3_task_field bits */
+	__u64 rss_pages;     /* resident pages, anonymous, file and shared */
+	__u64 swap_pages;    /* pages swapped out */
+	__u64 thp_pages;     /* pages mapped by transparent huge pages */
+	__u64 numa_local;    /* present pages on the node of the cpu the task last ran on */
+	__u64 numa_remote;   /* present pages on other nodes */
+	__u64 thp_faults;    /* huge pages allocated on fault, system wide, aggregate records only */
+	__u64 thp_fallbacks; /* huge page faults that fell back to small pages, system wide, aggregate records only */
+};
+
+/**
+ * @brief what a VMA of a heat record maps
+ */
+enum mp3_heat_kind {
+	MP3_HEAT_ANON = 0,  /* anonymous memory, e.g. large malloc blocks */
+	MP3_HEAT_FILE = 1,  /* a mapped file */
+	MP3_HEAT_HEAP = 2,  /* the brk heap */
+	MP3_HEAT_STACK = 3, /* the main thread stack */
+};
+
+/**
+ * @brief the sampled faults of one VMA of one task during one interval. The
+ * VMA is split into MP3_HEAT_BUCKETS buckets of bucket_size bytes, the last
+ * one may end past vm_end.
+ */
+struct mp3_heat_record {
+	struct mp3_record_header hdr;
+	__u64 vm_start;
+	__u64 vm_end;
+	__u64 bucket_size; /* a multiple of the page size */
+	__u32 faults;      /* sum of the buckets */
+	__u32 kind;        /* enum mp3_heat_kind */
+	__u32 buckets[MP3_HEAT_BUCKETS];
+};
+
+/**
+ * @brief the thrashing control actions
+ */
+enum mp3_control_action {
+	MP3_CONTROL_SUSPEND = 0, /* the thread group was stopped with SIGSTOP */
+	MP3_CONTROL_RESUME = 1,  /* the thread group was continued with SIGCONT */
+};
+
+/**
+ * @brief one decision of the thrashing controller, about the thread group
+ * hdr.pid. The rates are those of the sample that triggered it.
+ */
+struct mp3_control_record {
+	struct mp3_record_header hdr;
+	__u32 action;    /* enum mp3_control_action */
+	__u32 running;   /* thread groups of registered tasks left running after the decision */
+	__u32 suspended; /* thread groups of registered tasks suspended after the decision */
+	__u32 util_pct;  /* cpu time of all tasks over the interval, in percent of the online cpus */
+	__u64 maj_rate;  /* major faults per second of all tasks */
+	__u64 threshold; /* major faults per second that count as thrashing */
+};
+
+/**
+ * @brief registration flags, also written as letters after the pid of the R
+ * and U commands of /proc/mp3/status
+ */
+enum mp3_register_flags {
+	MP3_REGISTER_THREADS = 1 << 0,  /* 't': every thread of the thread group, and the ones it creates later */
+	MP3_REGISTER_CHILDREN = 1 << 1, /* 'c': every process it forks later, with the same flags, recursively */
+};
+
+/* pids per MP3_IOC_REGISTER or MP3_IOC_UNREGISTER call */
+#define MP3_REGISTER_MAX 4096
+
+/**
+ * @brief argument of the registration ioctls of the character device
+ */
+struct mp3_register {
+	__u32 flags; /* enum mp3_register_flags */
+	__u32 count; /* number of pids, at most MP3_REGISTER_MAX */
+	__u64 pids;  /* user pointer to count __s32 pids */
+};
+
+/* both return the number of tasks registered or unregistered */
+#define MP3_IOC_MAGIC 'M'
+#define MP3_IOC_REGISTER _IOW(MP3_IOC_MAGIC, 1, struct mp3_register)
+#define MP3_IOC_UNREGISTER _IOW(MP3_IOC_MAGIC, 2, struct mp3_register)
+/* sets the sampling interval of the session of the file, in microseconds */
+#define MP3_IOC_INTERVAL _IOW(MP3_IOC_MAGIC, 3, __u32)
+
+/*
+ * Minor 0 of the character device is the shared session of /proc/mp3/status.
+ * Every open of minor 1 creates a private session with its own tasks, buffer
+ * and interval, which ends when the file is closed and unmapped. Private
+ * sessions register tasks with the ioctls. There MP3_REGISTER_THREADS
+ * registers the threads that exist at the time of the ioctl, threads created
+ * later are not followed, and MP3_REGISTER_CHILDREN fails with -EINVAL.
+ * Private sessions neither sample fault addresses nor run the thrashing
+ * controller.
+ */
+#define MP3_MINOR_SHARED 0
+#define MP3_MINOR_SESSION 1
+
+#endif
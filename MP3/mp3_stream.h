@@ -0,0 +1,271 @@
+#ifndef __MP3_STREAM_INCLUDE__
+#define __MP3_STREAM_INCLUDE__
+
+// Stream file format written by the monitor collector (monitor -c) and read back by monitor -d and analyze.
+// The file starts with STREAM_MAGIC and a version byte. Every entry then starts with a tag byte:
+// a record type followed by the varint pid, the zigzag varint deltas of the jiffies and of the time_ns (against
+// the previous entry), the zigzag varint jitter_ns, and the deltas of the minor faults, major faults, cpu time and working set (against the previous
+// entry of the same pid), then the varint fields and the deltas of the memory counters in record order, or STREAM_LOST followed by the varint number of records dropped since
+// the previous STREAM_LOST entry. Heat records store the varint pid, the jiffies, time and jitter, and then
+// the varint start, length, bucket size and kind of the VMA followed by one varint per bucket.
+// Control records store the varint pid, the jiffies, time and jitter and then their fields as varints.
+//
+// Archives written by monitor -x start with RAW_MAGIC and the 32 bit version of the buffer they were spliced from,
+// followed by the raw records of the buffer, pad records included, in runs of whole records of one cpu at a time.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mp3_shared.h"
+
+#define STREAM_MAGIC "MP3S"
+#define STREAM_VERSION 6
+#define STREAM_LOST 0xff
+#define STREAM_HEADER_SIZE 5
+#define STREAM_MAX_PIDS 256   // Pids past this many are delta encoded against zero
+#define RAW_MAGIC "MP3R"
+#define RAW_HEADER_SIZE 8
+
+// Last values seen per pid, which the stream entries are delta encoded against
+struct stream_state {
+  unsigned pid;
+  uint64_t min_flt;
+  uint64_t maj_flt;
+  uint64_t cpu_time;
+  uint64_t wss_pages;
+  uint64_t rss_pages;
+  uint64_t swap_pages;
+  uint64_t thp_pages;
+  uint64_t numa_local;
+  uint64_t numa_remote;
+  uint64_t thp_faults;
+  uint64_t thp_fallbacks;
+};
+
+// The bases of all deltas, kept in step by the encoder and the decoder
+struct stream_table {
+  struct stream_state pids[STREAM_MAX_PIDS];
+  int npids;
+  struct stream_state scratch;
+  uint64_t jiffies;
+  uint64_t time_ns;
+};
+
+// One decoded entry
+union stream_record {
+  struct mp3_record_header hdr;
+  struct mp3_task_record task;
+  struct mp3_heat_record heat;
+  struct mp3_control_record control;
+};
+
+// Decoder of a stream held in memory
+struct stream_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t lost;
+  struct stream_table table;
+};
+
+// Reader of an archive of raw records held in memory
+struct raw_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint32_t version;
+};
+
+// This function returns the last values seen for a pid. Pids past STREAM_MAX_PIDS share a scratch entry
+// that is reset on every call, so they are encoded against zero. The encoder and the decoder both
+// use it, so they always agree on the base of every delta.
+static inline struct stream_state *stream_prev(struct stream_table *t, unsigned pid)
+{
+  int i;
+
+  for(i=0; i<t->npids; i++)
+    if(t->pids[i].pid == pid) return &t->pids[i];
+  if(t->npids == STREAM_MAX_PIDS){
+    memset(&t->scratch, 0, sizeof(t->scratch));
+    return &t->scratch;
+  }
+  memset(&t->pids[t->npids], 0, sizeof(t->pids[0]));
+  t->pids[t->npids].pid = pid;
+  return &t->pids[t->npids++];
+}
+
+// This function reads one varint, and returns -1 at the end of the stream.
+static inline int stream_varint(struct stream_reader *r, uint64_t *v)
+{
+  int shift = 0;
+  unsigned char c;
+
+  *v = 0;
+  do {
+    if(r->p == r->end || shift > 63)
+      return -1;
+    c = *r->p++;
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while(c & 0x80);
+  return 0;
+}
+
+// This function reads one zigzag delta and applies it to base.
+static inline int stream_delta(struct stream_reader *r, uint64_t *base)
+{
+  uint64_t z;
+
+  if(stream_varint(r, &z))
+    return -1;
+  *base += (z >> 1) ^ (0 - (z & 1));
+  return 0;
+}
+
+// This function starts decoding a stream of len bytes at buf, and returns -1 if it is not a stream of this version.
+static inline int stream_open(struct stream_reader *r, const void *buf, size_t len)
+{
+  memset(r, 0, sizeof(*r));
+  if(len < STREAM_HEADER_SIZE || memcmp(buf, STREAM_MAGIC, 4) || ((const unsigned char *)buf)[4] != STREAM_VERSION)
+    return -1;
+  r->p = (const unsigned char *)buf + STREAM_HEADER_SIZE;
+  r->end = (const unsigned char *)buf + len;
+  return 0;
+}
+
+// This function decodes the next record into rec. STREAM_LOST entries are added to r->lost.
+// It returns 1 if a record was decoded, 0 at the end of the stream and -1 if the last entry is truncated.
+static inline int stream_next(struct stream_reader *r, union stream_record *rec)
+{
+  struct stream_state *prev;
+  uint64_t v, start, len, size, f[6], jitter = 0;
+  int i;
+
+  while(1){
+    if(r->p == r->end)
+      return 0;
+    if(stream_varint(r, &v))
+      return -1;
+    if(v != STREAM_LOST)
+      break;
+    if(stream_varint(r, &v))
+      return -1;
+    r->lost += v;
+  }
+
+  memset(&rec->hdr, 0, sizeof(rec->hdr));
+  rec->hdr.type = v;
+  if(stream_varint(r, &v) || stream_delta(r, &r->table.jiffies) || stream_delta(r, &r->table.time_ns) ||
+     stream_delta(r, &jitter))
+    return -1;
+  rec->hdr.pid = v;
+  rec->hdr.jiffies = r->table.jiffies;
+  rec->hdr.time_ns = r->table.time_ns;
+  rec->hdr.jitter_ns = (int64_t)jitter;
+
+  if(rec->hdr.type == MP3_RECORD_HEAT){
+    rec->hdr.size = sizeof(rec->heat);
+    rec->heat.faults = 0;
+    if(stream_varint(r, &start) || stream_varint(r, &len) || stream_varint(r, &size) || stream_varint(r, &v))
+      return -1;
+    rec->heat.vm_start = start;
+    rec->heat.vm_end = start + len;
+    rec->heat.bucket_size = size;
+    rec->heat.kind = v;
+    for(i=0; i<MP3_HEAT_BUCKETS; i++){
+      if(stream_varint(r, &v))
+        return -1;
+      rec->heat.buckets[i] = v;
+      rec->heat.faults += v;
+    }
+    return 1;
+  }
+
+  if(rec->hdr.type == MP3_RECORD_CONTROL){
+    rec->hdr.size = sizeof(rec->control);
+    for(i=0; i<6; i++)
+      if(stream_varint(r, &f[i]))
+        return -1;
+    rec->control.action = f[0];
+    rec->control.running = f[1];
+    rec->control.suspended = f[2];
+    rec->control.util_pct = f[3];
+    rec->control.maj_rate = f[4];
+    rec->control.threshold = f[5];
+    return 1;
+  }
+
+  rec->hdr.size = sizeof(rec->task);
+  prev = stream_prev(&r->table, rec->hdr.pid);
+  if(stream_delta(r, &prev->min_flt) || stream_delta(r, &prev->maj_flt) ||
+     stream_delta(r, &prev->cpu_time) || stream_delta(r, &prev->wss_pages) || stream_varint(r, &v) ||
+     stream_delta(r, &prev->rss_pages) || stream_delta(r, &prev->swap_pages) || stream_delta(r, &prev->thp_pages) ||
+     stream_delta(r, &prev->numa_local) || stream_delta(r, &prev->numa_remote) ||
+     stream_delta(r, &prev->thp_faults) || stream_delta(r, &prev->thp_fallbacks))
+    return -1;
+  rec->task.min_flt = prev->min_flt;
+  rec->task.maj_flt = prev->maj_flt;
+  rec->task.cpu_time = prev->cpu_time;
+  rec->task.wss_pages = prev->wss_pages;
+  rec->task.fields = v;
+  rec->task.rss_pages = prev->rss_pages;
+  rec->task.swap_pages = prev->swap_pages;
+  rec->task.thp_pages = prev->thp_pages;
+  rec->task.numa_local = prev->numa_local;
+  rec->task.numa_remote = prev->numa_remote;
+  rec->task.thp_faults = prev->thp_faults;
+  rec->task.thp_fallbacks = prev->thp_fallbacks;
+  return 1;
+}
+
+// This function returns a record of a buffer of the given version with the current record header. Modules before
+// version 7 write a header that ends with jiffies, so the record is copied into buf with the body moved behind the
+// longer header and no time_ns.
+static inline struct mp3_record_header *stream_record_of(uint32_t version, struct mp3_record_header *rec,
+                                                         union stream_record *buf)
+{
+  size_t body = rec->size - MP3_RECORD_HEADER_V6_SIZE;
+
+  if(version >= 7)
+    return rec;
+  if(body > sizeof(*buf) - sizeof(buf->hdr))
+    body = sizeof(*buf) - sizeof(buf->hdr);
+  memset(buf, 0, sizeof(*buf));
+  memcpy(buf, rec, MP3_RECORD_HEADER_V6_SIZE);
+  memcpy((unsigned char *)buf + sizeof(buf->hdr), (unsigned char *)rec + MP3_RECORD_HEADER_V6_SIZE, body);
+  buf->hdr.size = sizeof(buf->hdr) + body;
+  return &buf->hdr;
+}
+
+// This function starts reading an archive of len bytes at buf, and returns -1 if it is not an archive.
+static inline int raw_open(struct raw_reader *r, const void *buf, size_t len)
+{
+  memset(r, 0, sizeof(*r));
+  if(len < RAW_HEADER_SIZE || memcmp(buf, RAW_MAGIC, 4))
+    return -1;
+  memcpy(&r->version, (const unsigned char *)buf + 4, 4);
+  r->p = (const unsigned char *)buf + RAW_HEADER_SIZE;
+  r->end = (const unsigned char *)buf + len;
+  return 0;
+}
+
+// This function returns the next record of an archive with the current record header, converted into buf if needed,
+// and skips pad records. It returns NULL at the end of the archive, and sets *truncated if the last record is cut
+// short or corrupt.
+static inline struct mp3_record_header *raw_next(struct raw_reader *r, union stream_record *buf, int *truncated)
+{
+  struct mp3_record_header *rec;
+
+  *truncated = 0;
+  while(r->p != r->end){
+    rec = (struct mp3_record_header *)r->p;
+    if((size_t)(r->end - r->p) < MP3_RECORD_ALIGN || rec->size < MP3_RECORD_ALIGN || rec->size > r->end - r->p){
+      *truncated = 1;
+      return NULL;
+    }
+    r->p += rec->size;
+    if(rec->type != MP3_RECORD_PAD)
+      return stream_record_of(r->version, rec, buf);
+  }
+  return NULL;
+}
+
+#endif
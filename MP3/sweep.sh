@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs work for every combination of process count and memory size and collects one MP3 profile per run into
+# <outdir>/n<processes>-m<MB>-<locality>-<run>.stream, which ./analyze -t groups by process count.
+# Needs root, the module loaded and the device node created as described in the README.
+#
+# usage: ./sweep.sh [-n "1 5 11"] [-m "200"] [-r runs] [-o outdir] [-- work options and arguments]
+# the work arguments default to: 200 R 10000 ("<memsize>" in them is replaced by the size of every run)
+
+procs="1 5 11"
+sizes="200"
+runs=1
+outdir=profiles
+
+while getopts "n:m:r:o:" opt; do
+  case $opt in
+    n) procs=$OPTARG ;;
+    m) sizes=$OPTARG ;;
+    r) runs=$OPTARG ;;
+    o) outdir=$OPTARG ;;
+    *) sed -n '2,7p' "$0"; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- "<memsize>" R 10000
+
+mkdir -p "$outdir" || exit 1
+for n in $procs; do
+  for m in $sizes; do
+    for r in $(seq 1 "$runs"); do
+      args=$(echo "$@" | sed "s/<memsize>/$m/")
+      locality=$(echo "$args" | awk '{ for(i = 1; i <= NF; i++) if($i ~ /^[RTSDZP]$/) { print $i; exit } }')
+      out="$outdir/n$n-m$m-$locality-$r.stream"
+      echo "== $n processes, ${m}MB, work $args -> $out"
+
+      ./monitor -c "$out" &
+      collector=$!
+      pids=""
+      for i in $(seq 1 "$n"); do
+        nice ./work $args > /dev/null &
+        pids="$pids $!"
+      done
+      wait $pids
+      # let the last samples reach the ring before the collector drains it for the last time
+      sleep 1
+      kill -INT $collector
+      wait $collector
+    done
+  done
+done
+
+# one thrashing curve per memory size
+for m in $sizes; do
+  echo "== ${m}MB"
+  ./analyze -t "$outdir"/n*-m$m-*.stream | sed -n '/^processes/,$p'
+done
@@ -1,119 +1,389 @@
 #include <stdio.h>
 #include <sys/syscall.h>
 #include <unistd.h>
-#include <stdio.h>
-#include <unistd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #define N_ITERATION 20
+#define MAX_THREADS 64
+#define CACHE_LINE 64
+#define PAGE 4096
+#define MB (1024UL*1024)
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+// The access patterns, selected by the first letter of the locality argument
+enum pattern {
+  RANDOM,     // R: uniform random bytes, as the original work
+  TEMPORAL,   // T: 20% random bytes, 80% within 300 bytes after the previous one
+  SEQUENTIAL, // S: every cache line in address order
+  STRIDED,    // D: one byte every stride bytes in address order, one cache line further every lap
+  ZIPF,       // Z: pages ranked by a Zipf distribution, scattered over the buffer
+  CHASE,      // P: a pointer chase visiting every page once per lap in a random order
+};
+
+// One worker thread
+struct worker {
+  pthread_t thread;
+  unsigned id;
+  uint64_t seed;
+  uint64_t accesses;
+  uint64_t ns;
+};
+
+static char *buffer;
+static size_t bsize;
+static size_t npages;
+static enum pattern pattern;
+static long naccess;
+static int iterations = N_ITERATION;
+static int pause_ms = 1000;
+static size_t stride = PAGE;
+static double theta = 0.99;
+static int do_register = 1;
+static struct worker workers[MAX_THREADS];
+static unsigned nthreads = 1;
+
+// Zipf constants of the Gray et al. generator, computed once for npages
+static double zipf_zetan, zipf_eta, zipf_alpha, zipf_half;
+
+// This function returns the next number of a xorshift64* generator. It replaces rand(), which takes a lock
+// on every call and only has 31 bits, too few to address more than 2GB.
+static inline uint64_t next_rand(uint64_t *s)
+{
+  uint64_t x = *s;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *s = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// This function returns a uniform double in [0, 1)
+static inline double next_double(uint64_t *s)
+{
+  return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// This function returns the current time in nanoseconds
+uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// This function sets up the Zipf generator over npages pages. zeta(n) is summed once, which takes a few ms
+// for a GB of pages.
+void zipf_init()
+{
+  double zeta2 = 1.0 + pow(0.5, theta);
+  size_t i;
+
+  zipf_zetan = 0;
+  for(i=1; i<=npages; i++)
+    zipf_zetan += pow((double)i, -theta);
+  zipf_alpha = 1.0 / (1.0 - theta);
+  zipf_eta = (1.0 - pow(2.0 / npages, 1.0 - theta)) / (1.0 - zeta2 / zipf_zetan);
+  zipf_half = zeta2;
+}
+
+// This function returns a page picked by the Zipf distribution. Rank 0 is the most popular page; ranks are
+// scattered over the buffer by a multiplicative hash so that the hot pages are not all adjacent.
+static inline size_t zipf_page(uint64_t *s)
+{
+  double u = next_double(s), uz = u * zipf_zetan;
+  size_t rank;
+
+  if(uz < 1.0)
+    rank = 0;
+  else if(uz < zipf_half)
+    rank = 1;
+  else
+    rank = (size_t)(npages * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+  if(rank >= npages)
+    rank = npages - 1;
+  return (size_t)((rank * 2654435761ULL) % npages);
+}
+
+// This function returns where the link of a page is stored: one cache line of the page picked by a hash, so
+// that the links do not all map to the same cache sets.
+static inline size_t chase_slot(size_t page)
+{
+  return page * PAGE + ((page * 2654435761ULL) >> 7) % (PAGE / CACHE_LINE) * CACHE_LINE;
+}
+
+// This function links every page of the buffer into one cycle in a random order (Sattolo's algorithm). The
+// link of each page holds the offset of the link of the next page, so every hop is a dependent load to a new
+// page.
+int chase_init()
+{
+  uint64_t seed = 0x9E3779B97F4A7C15ULL;
+  uint32_t *order, tmp;
+  size_t i, j;
+
+  order = malloc(npages * sizeof(uint32_t));
+  if(!order)
+    return -1;
+  for(i=0; i<npages; i++)
+    order[i] = i;
+  for(i=npages-1; i>0; i--){
+    j = next_rand(&seed) % i;
+    tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  // order is now a single cycle: page i links to page order[i]
+  for(i=0; i<npages; i++)
+    *(size_t *)(buffer + chase_slot(i)) = chase_slot(order[i]);
+  free(order);
+  return 0;
+}
+
+// This function runs naccess accesses of the configured pattern, starting at *pos, and returns a value
+// depending on the loads so that the compiler keeps them.
+size_t run_accesses(struct worker *w, size_t *pos)
+{
+  size_t p = *pos, sum = 0;
+  long j;
+
+  switch(pattern){
+    case RANDOM:
+      for(j=0; j<naccess; j++)
+        buffer[next_rand(&w->seed) % bsize] = '*';
+      break;
+    case TEMPORAL:
+      for(j=0; j<naccess; j++){
+        if(next_rand(&w->seed) % 10 < 2)
+          p = next_rand(&w->seed) % bsize;
+        else
+          p = (p + next_rand(&w->seed) % 300) % bsize;
+        buffer[p] = '*';
+      }
+      break;
+    case SEQUENTIAL:
+      for(j=0; j<naccess; j++){
+        buffer[p] = '*';
+        p += CACHE_LINE;
+        if(p >= bsize)
+          p = 0;
+      }
+      break;
+    case STRIDED:
+      for(j=0; j<naccess; j++){
+        buffer[p] = '*';
+        p += stride;
+        if(p >= bsize)
+          p = (p % stride + CACHE_LINE) % stride;   // next lap, one cache line further
+      }
+      break;
+    case ZIPF:
+      for(j=0; j<naccess; j++)
+        buffer[zipf_page(&w->seed) * PAGE + (next_rand(&w->seed) % PAGE)] = '*';
+      break;
+    case CHASE:
+      for(j=0; j<naccess; j++){
+        p = *(volatile size_t *)(buffer + p);
+        sum += p;
+      }
+      break;
+  }
+  *pos = p;
+  return sum;
+}
 
-char *buffer[1024];
+// This function registers or unregisters this process with the MP3 kernel module. The t flag covers every thread
+// of the process, including the workers created after the registration.
+void mp3_command(char cmd, pid_t pid)
+{
+  FILE *f;
 
-int msize;
+  if(!do_register)
+    return;
+  f = fopen("/proc/mp3/status", "w");
+  if(!f){
+    perror("/proc/mp3/status");
+    return;
+  }
+  fprintf(f, "%c %u t", cmd, pid);
+  fclose(f);
+}
 
-// This function emualtes a random memory access
-void rand_access()
+// This function is the body of a worker thread. Every thread starts at its own position in the buffer, and is
+// profiled as a task of its own since the process registered with its threads.
+void *worker_main(void *arg)
 {
-  int target;
-  int blk;
-
-  target = rand() % (msize * 1024*1024);
-  if(target<0)
-    target *= -1;
-  blk = target / 1024/1024;
-  buffer[blk][target-blk*1024*1024] = '*';
+  struct worker *w = arg;
+  pid_t tid = syscall(__NR_gettid);
+  size_t pos, sink = 0;
+  uint64_t start;
+  int k;
+
+  pos = (bsize / nthreads) * w->id;
+  if(pattern == CHASE)
+    pos = chase_slot(pos / PAGE);
+  else if(pattern == STRIDED)
+    pos -= pos % stride;
+
+  for(k=0; k<iterations; k++){
+    printf("[%d] %d iteration\n", tid, k);
+    start = now_ns();
+    sink += run_accesses(w, &pos);
+    w->ns += now_ns() - start;
+    w->accesses += naccess;
+    if(pause_ms)
+      usleep(pause_ms * 1000);
+  }
+
+  return (void *)sink;
 }
 
-// This function emualtes a memory access that has a temporal locality
-int local_access(int addr)
+// This function maps the buffer as one anonymous mapping, backed by hugetlbfs pages if asked to, and applies
+// the madvise advice, if any.
+int map_buffer(int hugetlb, const char *advice)
 {
-  if(rand() < 0){
-    return addr + 1;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | (hugetlb ? MAP_HUGETLB : 0);
+  int adv = -1;
+
+  buffer = mmap(NULL, bsize, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(buffer == MAP_FAILED){
+    perror(hugetlb ? "mmap MAP_HUGETLB (are huge pages reserved in /proc/sys/vm/nr_hugepages?)" : "mmap");
+    return -1;
   }
-  else{
-    return addr + rand() % 300;
+  if(!advice)
+    return 0;
+  if(!strcmp(advice, "random"))
+    adv = MADV_RANDOM;
+  else if(!strcmp(advice, "sequential"))
+    adv = MADV_SEQUENTIAL;
+#ifdef MADV_HUGEPAGE
+  else if(!strcmp(advice, "hugepage"))
+    adv = MADV_HUGEPAGE;
+  else if(!strcmp(advice, "nohugepage"))
+    adv = MADV_NOHUGEPAGE;
+#endif
+  if(adv < 0){
+    printf("unknown madvise advice %s\n", advice);
+    return -1;
   }
+  if(madvise(buffer, bsize, adv))
+    perror("madvise");
+  return 0;
+}
+
+void usage(const char *name)
+{
+  printf("usage: %s [options] <memsize in MB> <locality> <# of memory accesses per iteration>\n", name);
+  printf("locality: R random, T temporal, S sequential, D strided, Z zipf, P pointer chase\n");
+  printf("  -t <threads>     worker threads, each registered with MP3 (1)\n");
+  printf("  -i <iterations>  iterations of every thread (%d)\n", N_ITERATION);
+  printf("  -p <ms>          pause between iterations (1000)\n");
+  printf("  -s <bytes>       stride of D (%d)\n", PAGE);
+  printf("  -z <theta>       skew of Z, between 0 and 1 exclusive (0.99)\n");
+  printf("  -H               back the buffer with hugetlbfs pages\n");
+  printf("  -m <advice>      madvise the buffer: random, sequential, hugepage or nohugepage\n");
+  printf("  -n               do not register with MP3\n");
 }
 
 int main(int argc, char* argv[])
 {
-  char cmd[120];
-  pid_t mypid;
-  int i, j, k;
-  int locality;
-  int naccess;
-
-  if(argc<4){
-    printf("usage: work <memsize in MB> <locality: R for Random or T for Temporal> <# of memory accesses per iteration>");
+  const char *advice = NULL;
+  int opt, hugetlb = 0;
+  long msize;
+  unsigned i;
+  uint64_t accesses = 0, ns = 0;
+
+  while((opt = getopt(argc, argv, "t:i:p:s:z:Hm:n")) != -1){
+    switch(opt){
+      case 't': nthreads = atoi(optarg); break;
+      case 'i': iterations = atoi(optarg); break;
+      case 'p': pause_ms = atoi(optarg); break;
+      case 's': stride = strtoul(optarg, NULL, 0); break;
+      case 'z': theta = atof(optarg); break;
+      case 'H': hugetlb = 1; break;
+      case 'm': advice = optarg; break;
+      case 'n': do_register = 0; break;
+      default: usage(argv[0]); return -1;
+    }
+  }
+  if(argc - optind < 3){
+    usage(argv[0]);
     return -1;
   }
 
-  msize = atoi(argv[1]);
-  if(msize>1024 || msize<1){
-    printf("memsize shall be between 1 and 1024\n");
+  msize = atol(argv[optind]);
+  if(msize<1){
+    printf("memsize shall be >=1\n");
     return -1;
   }
+  bsize = msize * MB;
+  npages = bsize / PAGE;
 
-  locality = (argv[2][0]=='R')?0:1;
+  switch(argv[optind+1][0]){
+    case 'R': pattern = RANDOM; break;
+    case 'T': pattern = TEMPORAL; break;
+    case 'S': pattern = SEQUENTIAL; break;
+    case 'D': pattern = STRIDED; break;
+    case 'Z': pattern = ZIPF; break;
+    case 'P': pattern = CHASE; break;
+    default: usage(argv[0]); return -1;
+  }
 
-  naccess = atoi(argv[3]);
+  naccess = atol(argv[optind+2]);
   if(naccess<1){
     printf("naccess shall be >=1\n");
     return -1;
   }
+  if(nthreads<1 || nthreads>MAX_THREADS || iterations<1 || pause_ms<0 || !stride || stride>=bsize ||
+     theta<=0 || theta>=1){
+    printf("invalid option\n");
+    return -1;
+  }
 
-  printf("A work prcess starts (configuration: %d %d %d)\n", msize, locality, naccess); 
-
-  // 1. Register itself to the MP3 kernel module for profiling.
-  mypid = syscall(__NR_gettid);
-  sprintf(cmd, "echo 'R %u'>//proc/mp3/status", mypid);
-  system(cmd);
-
-  // 2. Allocate memory blocks
-  for(i=0; i<msize; i++){
-    buffer[i] = malloc(1024*1024);
-    if(buffer[i] == NULL){
-      for(i--; i>=0; i--)
-        free(buffer[i]);
-      printf("Out of memory error! (failed at %dMB)\n", i);
-      return -1;
-    }
+  printf("A work prcess starts (configuration: %ld %c %ld, %u threads)\n", msize, argv[optind+1][0], naccess, nthreads);
+
+  // 1. Map the buffer, as one mapping instead of 1MB malloc blocks so that hugepages and madvise apply to all of it
+  if(map_buffer(hugetlb, advice))
+    return -1;
+  if(pattern == ZIPF)
+    zipf_init();
+  if(pattern == CHASE && chase_init()){
+    printf("Out of memory error!\n");
+    return -1;
   }
 
-  // 3. Access allocated memory blocks using the specified access policy
-  int addr = 0;
-  for (k=0;k<N_ITERATION; k++){
-     printf("[%d] %d iteration\n", mypid, k);
-     if(!locality){
-       for(j=0; j<naccess; j++){
-         rand_access();
-       }
-     }
-     else{
-       for(j=0; j<naccess; j++){
-         int locality = rand() % 10;
-         if(locality > -2 && locality < 2){ /* random access */
-           rand_access();
-         }
-         else{ /* local access */
-           addr = local_access(addr);
-	 }
-       }
-     }
-     sleep(1);
+  // 2. Register to the MP3 kernel module for profiling, with the threads about to be created, and run the workers
+  mp3_command('R', getpid());
+  for(i=0; i<nthreads; i++){
+    workers[i].id = i;
+    workers[i].seed = 0x853C49E6748FEA9BULL ^ ((uint64_t)getpid() << 16) ^ (i + 1);
+    if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])){
+      printf("cannot create thread %u\n", i);
+      nthreads = i;
+      break;
+    }
   }
-  
-  // 4. Free memory blocks
-  for(i=0; i<msize; i++){
-    free(buffer[i]);
+  for(i=0; i<nthreads; i++){
+    pthread_join(workers[i].thread, NULL);
+    accesses += workers[i].accesses;
+    ns += workers[i].ns;
   }
 
-  // 5. Unregister itself to stop the profiling
-  sprintf(cmd, "echo 'U %u'>//proc/mp3/status", mypid);
-  system(cmd);
-}
+  // 3. Unregister to stop the profiling and free the buffer
+  mp3_command('U', getpid());
+  munmap(buffer, bsize);
 
+  if(accesses)
+    printf("[%d] %llu accesses, %.1f ns per access\n", getpid(), (unsigned long long)accesses, (double)ns / accesses);
+  return 0;
+}
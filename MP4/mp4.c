@@ -7,22 +7,68 @@
 #include <linux/cred.h>
 #include <linux/dcache.h>
 #include <linux/binfmts.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
 #include "mp4_given.h"
 
 #define INODE_XATTR_LEN 255
+#define MP4_LABEL_LEN 16	/* longer than every label */
+#define MP4_SID_UNKNOWN (-1)	/* the xattr of the inode was not read yet */
+#define MP4_SKIP_NAME_LEN 6	/* the longest skipped prefix, /events, without '/' */
+/* low bits of mp4_inode_security.skip, the rename_lock sequence is above */
+#define MP4_SKIP_VALID 1	/* the answer was computed */
+#define MP4_SKIP_YES 2		/* the path of the inode is skipped */
+
+/**
+ * Our mp4 security blob on inodes
+ * @sid: the label of the inode, cached the first time it is checked and
+ *	 updated when its xattr is set or removed
+ * @skip: if the path of the inode is skipped, cached until the next rename
+ * @rcu: frees the blob after lockless permission checks are done with it
+ */
+struct mp4_inode_security {
+	int sid;
+	atomic64_t skip;
+	struct rcu_head rcu;
+};
 
 //forward declaring
 static int mp4_cred_alloc_blank(struct cred *cred, gfp_t gfp);
 
 /**
- * get_inode_sid - Get the inode mp4 security label id
+ * mp4_value_to_sid - Get the label id from an xattr value
+ *
+ * @value: the value, which need not be NUL terminated
+ * @size: the length of the value
+ *
+ * returns the sid of the label, MP4_NO_ACCESS if it is not a label
+ *
+ */
+static int mp4_value_to_sid(const char *value, size_t size)
+{
+	//Copy to terminate the value, labels are short
+	char ctx[MP4_LABEL_LEN];
+
+	if(!value)
+		return MP4_NO_ACCESS;
+	size = strnlen(value, size);
+	if(size >= MP4_LABEL_LEN)
+		return MP4_NO_ACCESS;
+	memcpy(ctx, value, size);
+	ctx[size] = '\0';
+	return __cred_ctx_to_sid(ctx);
+}
+
+/**
+ * read_inode_sid - Read the inode mp4 security label id from its xattr
  *
  * @inode: the input inode
  *
- * @return the inode's security id if found.
+ * @return the inode's security id, MP4_NO_ACCESS if it has no label, or a
+ * negative error if it could not be read.
  *
  */
-static int get_inode_sid(struct inode *inode)
+static int read_inode_sid(struct inode *inode)
 {
 	//File system variables
 	char *buf;
@@ -30,13 +76,11 @@ static int get_inode_sid(struct inode *inode)
 
 	//Credential fetching variables
 	int rc;
-	int xattr_cred;
+	int xattr_cred = MP4_NO_ACCESS;
 
-	//Sanitizing variable
-	if(!inode){
-		pr_alert("Returning EINVAL at %d\n", __LINE__);
-		return -EINVAL;
-	}
+	//Inodes without getxattr can not be labeled
+	if(!inode->i_op->getxattr)
+		return MP4_NO_ACCESS;
 
 	dentry = d_find_alias(inode);
 	if(!dentry){
@@ -45,30 +89,66 @@ static int get_inode_sid(struct inode *inode)
 	}
 
 	//Allocate a buffer to copy XATTR data too
-	buf = kmalloc(INODE_XATTR_LEN, GFP_KERNEL);
+	buf = kmalloc(INODE_XATTR_LEN, GFP_NOFS);
 	if(!buf){
+		dput(dentry);
 		pr_alert("Returning ENOMEM at %d\n", __LINE__);
 		return -ENOMEM;
 	}
 
-	buf[INODE_XATTR_LEN] = '\0';
+	//Get XATTR data, errors other than ENOMEM mean there is no label
+	rc = inode->i_op->getxattr(dentry, XATTR_NAME_MP4,
+							   buf, INODE_XATTR_LEN);
+	dput(dentry);
+	if(rc > 0)
+		xattr_cred = mp4_value_to_sid(buf, rc);
+	else if(rc == -ENOMEM)
+		xattr_cred = -ENOMEM;
 
-	//Get XATTR data
-	if(inode->i_op->getxattr){
-		rc = inode->i_op->getxattr(dentry, XATTR_NAME_MP4,
-								   buf, INODE_XATTR_LEN);
-		dput(dentry);
-		if(rc && rc != -ENODATA){
-			buf[rc] = '\0';
-			xattr_cred = __cred_ctx_to_sid(buf);
-			//Return XATTR if exists
-			kfree(buf);
-			return xattr_cred;
-		}
-	}
-	//Else return MP4_NO_ACCESS
 	kfree(buf);
-	return MP4_NO_ACCESS;
+	return xattr_cred;
+}
+
+/**
+ * get_inode_sid - Get the inode mp4 security label id
+ *
+ * @inode: the input inode
+ *
+ * The label is cached in the inode security blob, so only the first check
+ * of an inode reads its xattr. Setting or removing the xattr happens under
+ * i_mutex, from the setxattr or removexattr hook that forgets the label until
+ * the xattr is written, so the label is only cached when it is read under
+ * i_mutex. If i_mutex is taken, maybe by an update, it is read uncached.
+ *
+ * @return the inode's security id if found.
+ *
+ */
+static int get_inode_sid(struct inode *inode)
+{
+	struct mp4_inode_security *isec;
+	int sid;
+
+	//Sanitizing variable
+	if(!inode){
+		pr_alert("Returning EINVAL at %d\n", __LINE__);
+		return -EINVAL;
+	}
+
+	//Inodes created before the module was loaded have no blob
+	isec = inode->i_security;
+	if(isec){
+		sid = READ_ONCE(isec->sid);
+		if(sid != MP4_SID_UNKNOWN)
+			return sid;
+	}
+
+	if(!isec || !mutex_trylock(&inode->i_mutex))
+		return read_inode_sid(inode);
+	sid = read_inode_sid(inode);
+	if(sid >= 0)
+		WRITE_ONCE(isec->sid, sid);
+	mutex_unlock(&inode->i_mutex);
+	return sid;
 }
 
 /**
@@ -202,10 +282,7 @@ static int mp4_cred_prepare(struct cred *new, const struct cred *old,
 /**
  * mp4_inode_init_security - Set the security attribute of a newly created inode
  *
- * @inode: the newly created i
-			if(printk_ratelimit()){
-				pr_alert("rc is %d, buf is %s, returning %d\n", rc, buf, xattr_cred);
-			}node
+ * @inode: the newly created inode
  * @dir: the containing directory
  * @qstr: unused
  * @name: where to put the attribute name
@@ -220,9 +297,9 @@ static int mp4_inode_init_security(struct inode *inode, struct inode *dir,
 								   const char **name, void **value, size_t *len)
 {
 	//Helper pointer
-	const struct mp4_security tsec;
+	const struct mp4_security *tsec;
 
-	*tsec = current_security();
+	tsec = current_security();
 
 	//Input sanatizing
 	if(!tsec){
@@ -251,13 +328,252 @@ static int mp4_inode_init_security(struct inode *inode, struct inode *dir,
 	return -EOPNOTSUPP;
 }
 
+/**
+ * mp4_inode_alloc_security - Allocate the mp4 security blob of an inode
+ *
+ * @inode: the new inode
+ *
+ * returns 0 on success, -ENOMEM if no memory
+ *
+ */
+static int mp4_inode_alloc_security(struct inode *inode)
+{
+	struct mp4_inode_security *isec;
+
+	isec = kmalloc(sizeof(struct mp4_inode_security), GFP_NOFS);
+	if(!isec){
+		pr_alert("Returning ENOMEM at %d\n", __LINE__);
+		return -ENOMEM;
+	}
+
+	//The label is read the first time the inode is checked
+	isec->sid = MP4_SID_UNKNOWN;
+	atomic64_set(&isec->skip, 0);
+	inode->i_security = isec;
+
+	return 0;
+}
+
+/**
+ * mp4_inode_free_security - Free the mp4 security blob of an inode
+ *
+ * @inode: the inode being destroyed
+ *
+ */
+static void mp4_inode_free_security(struct inode *inode)
+{
+	struct mp4_inode_security *isec = inode->i_security;
+
+	if(!isec)
+		return;
+
+	//Permission checks of a RCU path walk may still be reading the blob
+	inode->i_security = NULL;
+	kfree_rcu(isec, rcu);
+}
+
+/**
+ * mp4_inode_setxattr - Check and prepare setting an xattr of an inode
+ *
+ * @dentry: the dentry of the inode
+ * @name: the attribute name
+ * @value: the attribute value
+ * @size: the length of the value
+ * @flags: the setxattr flags
+ *
+ * Forgets the cached label when the mp4 xattr is set. The caller holds
+ * i_mutex until the new value is written, so checks meanwhile read it again
+ * without caching it.
+ *
+ * returns 0 if the xattr may be set
+ *
+ */
+static int mp4_inode_setxattr(struct dentry *dentry, const char *name,
+							  const void *value, size_t size, int flags)
+{
+	struct mp4_inode_security *isec = d_backing_inode(dentry)->i_security;
+
+	if(isec && !strcmp(name, XATTR_NAME_MP4))
+		WRITE_ONCE(isec->sid, MP4_SID_UNKNOWN);
+
+	//Hooking setxattr replaces the capability check, so keep it
+	return cap_inode_setxattr(dentry, name, value, size, flags);
+}
+
+/**
+ * mp4_inode_post_setxattr - Update the cached label after an xattr is set
+ *
+ * @dentry: the dentry of the inode
+ * @name: the attribute name
+ * @value: the attribute value
+ * @size: the length of the value
+ * @flags: the setxattr flags
+ *
+ */
+static void mp4_inode_post_setxattr(struct dentry *dentry, const char *name,
+									const void *value, size_t size, int flags)
+{
+	struct mp4_inode_security *isec = d_backing_inode(dentry)->i_security;
+
+	if(isec && !strcmp(name, XATTR_NAME_MP4))
+		WRITE_ONCE(isec->sid, mp4_value_to_sid(value, size));
+}
+
+/**
+ * mp4_inode_removexattr - Check and prepare removing an xattr of an inode
+ *
+ * @dentry: the dentry of the inode
+ * @name: the attribute name
+ *
+ * Forgets the cached label when the mp4 xattr is removed. There is no hook
+ * after the removal, but the caller holds i_mutex until it is done, so checks
+ * meanwhile read the xattr without caching it.
+ *
+ * returns 0 if the xattr may be removed
+ *
+ */
+static int mp4_inode_removexattr(struct dentry *dentry, const char *name)
+{
+	struct mp4_inode_security *isec = d_backing_inode(dentry)->i_security;
+
+	if(isec && !strcmp(name, XATTR_NAME_MP4))
+		WRITE_ONCE(isec->sid, MP4_SID_UNKNOWN);
+
+	//Hooking removexattr replaces the capability check, so keep it
+	return cap_inode_removexattr(dentry, name);
+}
+
+/**
+ * mp4_dentry_should_skip - Check if the path of a dentry is to be skipped
+ *
+ * @dentry: the dentry
+ * @seq: where to put the rename_lock sequence the answer holds for
+ *
+ * Only the top level directory of a path decides if it is skipped, so only
+ * its name is checked instead of building the whole path. The walk to it is
+ * retried if a rename moves the dentry meanwhile.
+ *
+ * returns 1 if should skip, 0 otherwise
+ *
+ */
+static int mp4_dentry_should_skip(struct dentry *dentry, unsigned *seq)
+{
+	struct dentry *top;
+	char dir[MP4_SKIP_NAME_LEN + 2];
+	unsigned len;
+
+	rcu_read_lock();
+	do {
+		*seq = read_seqbegin(&rename_lock);
+
+		//Find the child of the root the dentry is in, the root is "/"
+		top = dentry;
+		while(!IS_ROOT(top) && !IS_ROOT(READ_ONCE(top->d_parent)))
+			top = READ_ONCE(top->d_parent);
+
+		//The prefixes are short, so the start of the name is enough
+		dir[0] = '/';
+		len = 0;
+		if(!IS_ROOT(top)){
+			len = min_t(unsigned, READ_ONCE(top->d_name.len), MP4_SKIP_NAME_LEN);
+			memcpy(dir + 1, READ_ONCE(top->d_name.name), len);
+		}
+		dir[len + 1] = '\0';
+	} while(read_seqretry(&rename_lock, *seq));
+	rcu_read_unlock();
+
+	return mp4_should_skip_path(dir);
+}
+
+/**
+ * mp4_inode_should_skip - Check if an inode is to be skipped, with the
+ * answer cached in its security blob
+ *
+ * @inode: the inode
+ *
+ * The cached answer holds until the next rename anywhere moves a dentry,
+ * which the sequence of rename_lock counts, so the check is a load and a
+ * compare until then. Computing it takes no reference and does not sleep,
+ * so it also runs in a RCU path walk, and the answer is published with the
+ * sequence its walk was consistent at.
+ *
+ * returns 1 if should skip, 0 otherwise
+ *
+ */
+static int mp4_inode_should_skip(struct inode *inode)
+{
+	struct mp4_inode_security *isec = inode->i_security;
+	struct dentry *dentry;
+	unsigned seq;
+	u64 state;
+	int skip;
+
+	if(isec){
+		state = atomic64_read(&isec->skip);
+		if((state & MP4_SKIP_VALID) && !read_seqretry(&rename_lock, (unsigned)(state >> 2)))
+			return (state & MP4_SKIP_YES) ? 1 : 0;
+	}
+
+	//Aliases are only dropped under i_lock, so the first one stays valid
+	//without a reference, and its parents stay valid under RCU
+	spin_lock(&inode->i_lock);
+	if(hlist_empty(&inode->i_dentry)){
+		spin_unlock(&inode->i_lock);
+		//Inodes without a dentry are not checked
+		pr_alert("%d dentry NULL!\n", __LINE__);
+		return 1;
+	}
+	dentry = hlist_entry(inode->i_dentry.first, struct dentry, d_u.d_alias);
+	skip = mp4_dentry_should_skip(dentry, &seq);
+	spin_unlock(&inode->i_lock);
+
+	if(isec)
+		atomic64_set(&isec->skip, (u64)seq << 2 | (skip ? MP4_SKIP_YES : 0) | MP4_SKIP_VALID);
+	return skip;
+}
+
+/**
+ * mp4_log_denial - Report an access denied by mp4_inode_permission
+ *
+ * @inode: the inode in question
+ * @inode_sec: the label of the inode
+ * @mask: the access requested
+ *
+ * Denials are rare, so only they pay for building the path of the inode.
+ *
+ */
+static void mp4_log_denial(struct inode *inode, int inode_sec, int mask)
+{
+	static const char * const names[] = {
+		"MP4_NO_ACCESS", "MP4_READ_OBJ", "MP4_READ_WRITE", "MP4_WRITE_OBJ",
+		"MP4_EXEC_OBJ", "MP4_READ_DIR", "MP4_RW_DIR", "MP4_TARGET_SID"
+	};
+	struct dentry *dentry;
+	char *buf, *path = "?";
+
+	buf = kmalloc(INODE_XATTR_LEN, GFP_NOFS);
+	dentry = d_find_alias(inode);
+	if(buf && dentry){
+		path = dentry_path_raw(dentry, buf, INODE_XATTR_LEN);
+		if(IS_ERR(path))
+			path = "?";
+	}
+	dput(dentry);
+
+	pr_info("Unallowed access: inode: %s has %s but requested operation has 0x%x\n", path,
+			inode_sec >= 0 && inode_sec < ARRAY_SIZE(names) ? names[inode_sec] : "?", mask);
+	kfree(buf);
+}
+
 /**
  * mp4_inode_permission - Check permission for an inode being opened
  *
  * @inode: the inode in question
  * @mask: the access requested
  *
- * This is the important access check hook
+ * This is the important access check hook. It runs for every component of
+ * every lookup, so when the skip decision and the label of the inode are
+ * cached it neither allocates nor builds paths.
  *
  * returns 0 if access is granted, -EACCES otherwise
  *
@@ -266,9 +582,6 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 {
 	//Helper variables
 	const struct mp4_security *tsec;
-	struct dentry *dentry;
-	char * buf;
-	char* path;
 	int inode_sec;
 
 	//Input sanitization
@@ -277,31 +590,18 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 		return 0;
 	}
 
-	//Get dentry
-	dentry = d_find_alias(inode);
-	if(!dentry){
-		dput(dentry);
-		pr_alert("%d dentry NULL!\n", __LINE__);
+	if(mp4_inode_should_skip(inode))
 		return 0;
-	}
 
-	//Allocate a buffer
-	buf = kmalloc(255 * sizeof(char), GFP_KERNEL);
-	if(!buf){
-		pr_alert("mp4.c:%d No memory\n", __LINE__);
-		return 0;
-	}
-	buf[254] = '\0';
+	tsec = current_security();
 
-	//Get path of inode
-	path = dentry_path_raw(dentry, buf, 254);
-	dput(dentry);
+	//Reading the xattr may sleep, so a RCU path walk retries with references
+	if(mask & MAY_NOT_BLOCK){
+		struct mp4_inode_security *isec = inode->i_security;
 
-	if(mp4_should_skip_path(path)){
-		return 0;
+		if(!isec || READ_ONCE(isec->sid) == MP4_SID_UNKNOWN)
+			return -ECHILD;
 	}
-
-	tsec = current_security();
 	inode_sec = get_inode_sid(inode);
 
 	//Snaitization check
@@ -313,37 +613,26 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 	if(tsec && tsec->mp4_flags == MP4_TARGET_SID){
 		switch (inode_sec) {
 			case MP4_NO_ACCESS:
-				pr_info("Unallowed access: inode: %s has MP4_NO_ACCESS but requested operation has 0x%x\n", path, mask);
 				goto BAD;
 			case MP4_READ_OBJ:
-				if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC)){
-					pr_info("Unallowed access: inode: %s has MP4_READ_OBJ but requested operation has 0x%x\n", path, mask);
+				if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC))
 					goto BAD;
-				}
 				break;
 			case MP4_READ_WRITE:
-				if(mask & (MAY_EXEC)){
-					pr_info("Unallowed access: inode: %s has MP4_READ_WRITE but requested operation has MAY_EXEC\n", path);
+				if(mask & (MAY_EXEC))
 					goto BAD;
-				}
 				break;
 			case MP4_WRITE_OBJ:
-				if(mask & (MAY_READ | MAY_EXEC)){
-					pr_info("Unallowed access: inode: %s has MP4_WRITE_OBJ but requested operation has 0x%x\n", path, mask);
+				if(mask & (MAY_READ | MAY_EXEC))
 					goto BAD;
-				}
 				break;
 			case MP4_EXEC_OBJ:
-				if(mask & (MAY_APPEND | MAY_WRITE)){
-					pr_info("Unallowed access: inode: %s has MP4_EXEC_OBJ but requested operation has 0x%x\n", path, mask);
+				if(mask & (MAY_APPEND | MAY_WRITE))
 					goto BAD;
-				}
 				break;
 			case MP4_READ_DIR:
-				if(mask & (MAY_APPEND | MAY_WRITE)){
-					pr_info("Unallowed access: inode: %s has MP4_READ_DIR but requested operation has 0x%x\n", path, mask);
+				if(mask & (MAY_APPEND | MAY_WRITE))
 					goto BAD;
-				}
 			default:
 				break;
 		}
@@ -353,28 +642,14 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 		} else {
 			switch (inode_sec) {
 				case MP4_READ_OBJ:
-					if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC)){
-						pr_info("Unallowed access: inode: %s has MP4_READ_OBJ but requested operation has 0x%x\n", path, mask);
-						goto BAD;
-					}
-					break;
 				case MP4_READ_WRITE:
-					if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC)){
-						pr_info("Unallowed access: inode: %s has MP4_READ_WRITE but requested operation has 0x%x\n", path, mask);
-						goto BAD;
-					}
-					break;
 				case MP4_WRITE_OBJ:
-					if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC)){
-						pr_info("Unallowed access: inode: %s has MP4_WRITE_OBJ but requested operation has 0x%x\n", path, mask);
+					if(mask & (MAY_APPEND | MAY_WRITE | MAY_EXEC))
 						goto BAD;
-					}
 					break;
 				case MP4_EXEC_OBJ:
-					if(mask & (MAY_APPEND | MAY_WRITE)){
-						pr_info("Unallowed access: inode: %s has MP4_EXEC_OBJ but requested operation has 0x%x\n", path, mask);
+					if(mask & (MAY_APPEND | MAY_WRITE))
 						goto BAD;
-					}
 					break;
 				default:
 					//ALLOW ACCESS
@@ -383,16 +658,12 @@ static int mp4_inode_permission(struct inode *inode, int mask)
 		}
 	}
 
-
-	/*
-	 * Add your code here
-	 * ...
-	 */
-
-	kfree(buf);
 	return 0;
 BAD:
-	kfree(buf);
+	//Build the path for the message outside of the RCU path walk
+	if(mask & MAY_NOT_BLOCK)
+		return -ECHILD;
+	mp4_log_denial(inode, inode_sec, mask);
 	return -EACCES;
 }
 
@@ -407,6 +678,13 @@ static struct security_hook_list mp4_hooks[] = {
 		LSM_HOOK_INIT(inode_init_security, mp4_inode_init_security),
 		LSM_HOOK_INIT(inode_permission, mp4_inode_permission),
 
+		/* inode security blob caching the label of the inode */
+		LSM_HOOK_INIT(inode_alloc_security, mp4_inode_alloc_security),
+		LSM_HOOK_INIT(inode_free_security, mp4_inode_free_security),
+		LSM_HOOK_INIT(inode_setxattr, mp4_inode_setxattr),
+		LSM_HOOK_INIT(inode_post_setxattr, mp4_inode_post_setxattr),
+		LSM_HOOK_INIT(inode_removexattr, mp4_inode_removexattr),
+
 		/*
 	 * setting the credentials subjective security label when laucnhing a
 	 * binary